@@ -29,6 +29,31 @@
 #define super QCABluetoothFirmware
 OSDefineMetaClassAndStructors(Ath3KFirmware, QCABluetoothFirmware)
 
+/* Every sysconfig in the catalog, by the crystal named in the file. A
+ * sysconfig for another crystal sets up the wrong clock, so a ROM and
+ * crystal without an entry (19.2 MHz, for one) is reported unsupported.
+ */
+static const Ath3KRampsEntry Ath3KRampsTable[] =
+{
+    { 0x01020001,   ATH3K_XTAL_FREQ_26M,    "ramps_0x01020001_26.dfu"   },
+    { 0x01020200,   ATH3K_XTAL_FREQ_26M,    "ramps_0x01020200_26.dfu"   },
+    { 0x01020200,   ATH3K_XTAL_FREQ_40M,    "ramps_0x01020200_40.dfu"   },
+    { 0x01020201,   ATH3K_XTAL_FREQ_26M,    "ramps_0x01020201_26.dfu"   },
+    { 0x01020201,   ATH3K_XTAL_FREQ_40M,    "ramps_0x01020201_40.dfu"   },
+    { 0x11020000,   ATH3K_XTAL_FREQ_40M,    "ramps_0x11020000_40.dfu"   },
+    { 0x11020100,   ATH3K_XTAL_FREQ_40M,    "ramps_0x11020100_40.dfu"   },
+    { 0x31010000,   ATH3K_XTAL_FREQ_40M,    "ramps_0x31010000_40.dfu"   },
+    { 0x31010100,   ATH3K_XTAL_FREQ_40M,    "ramps_0x31010100_40.dfu"   },
+    { 0x41020000,   ATH3K_XTAL_FREQ_40M,    "ramps_0x41020000_40.dfu"   },
+};
+
+IOService * Ath3KFirmware::probe(IOService * provider, SInt32 * score)
+{
+    m_probeTime = mach_absolute_time();
+    
+    return super::probe(provider, score);
+}
+
 bool Ath3KFirmware::start(IOService * provider)
 {
     if (!isAth3K())
@@ -38,6 +63,8 @@ bool Ath3KFirmware::start(IOService * provider)
     
     FuncLog("start");
     
+    invalidateDeviceState();
+    
     m_pUSBDevice = OSDynamicCast(IOUSBHostDevice, provider);
     
     if (!m_pUSBDevice)
@@ -46,6 +73,13 @@ bool Ath3KFirmware::start(IOService * provider)
         releaseAll();
         return false;
     }
+    
+    /* Patched and switched already, leave it to the transport driver */
+    if (Ath3KReenumTracker::isReattach(m_pUSBDevice))
+    {
+        m_pUSBDevice = NULL;
+        return false;
+    }
 
     powerStart(provider);
     
@@ -79,110 +113,201 @@ bool Ath3KFirmware::start(IOService * provider)
         return false;
     }
     
-    if (setNormalMode())
+    /* The downloads run off the matching thread */
+    return startBringUp();
+}
+
+bool Ath3KFirmware::bringUpDevice()
+{
+    /* Settle what will be loaded before changing anything on the device */
+    const Ath3KDeviceState * devState = NULL;
+    bool provisioned = isProvisioned();
+    
+    if (!provisioned && !(devState = getDeviceState()))
     {
-        WarningLog("(start) Failed to set normal mode!\n");
+        WarningLog("(bringUpDevice) Unable to read device state!\n");
         releaseAll();
-        return true;
+        return false;
     }
     
-    if (!loadPatchRom())
+    m_sysCfgName = NULL;
+    
+    if (!provisioned && !(devState->state & QCA_SYSCFG_UPDATED) && !(m_sysCfgName = findSysCfg(&devState->version)))
     {
-        WarningLog("(start) Failed to load patch rom!\n");
+        WarningLog("(bringUpDevice) Unsupported device, leaving it untouched!\n");
         releaseAll();
-        return true;
+        return false;
     }
     
-    if (!loadSysCfg())
+    if (provisioned)
     {
-        WarningLog("(start) Failed to load system configuration!\n");
-        releaseAll();
-        return true;
+        InfoLog("(bringUpDevice) Firmware is already loaded, only switching PID.\n");
     }
+    else
+    {
+        if (setNormalMode())
+        {
+            WarningLog("(bringUpDevice) Failed to set normal mode!\n");
+            releaseAll();
+            return false;
+        }
+        
+        if (!loadPatchRom())
+        {
+            WarningLog("(bringUpDevice) Failed to load patch rom!\n");
+            releaseAll();
+            return false;
+        }
+        
+        if (!loadSysCfg())
+        {
+            WarningLog("(bringUpDevice) Failed to load system configuration!\n");
+            releaseAll();
+            return false;
+        }
+        
+        /* Recorded as the device reports it now, which is what
+         * isProvisioned compares against when it comes back.
+         */
+        invalidateDeviceState();
+        
+        if ((devState = getDeviceState()))
+        {
+            QCAProvisionCache::save(m_pUSBDevice, __le32_to_cpu(devState->version.romVersion), __le32_to_cpu(devState->version.buildVersion));
+        }
+    }
+    
+    Ath3KReenumTracker::arm(m_pUSBDevice, m_probeTime);
     
     if (switchPID())
     {
-        WarningLog("(start) Failed to switch VID to PID!\n");
+        WarningLog("(bringUpDevice) Failed to switch VID to PID!\n");
         releaseAll();
-        return true;
+        return false;
     }
     
-    DebugLog("(start) Firmware loaded successfully!!!\n");
+    DebugLog("(bringUpDevice) Firmware loaded successfully!!!\n");
 
-    if (getDeviceStatus())
+    USBStatus status;
+    
+    if (getDeviceStatus(&status))
     {
-        WarningLog("(start) Unable to obtain device status!\n");
+        WarningLog("(bringUpDevice) Unable to obtain device status!\n");
         releaseAll();
         return true;
     }
     
-    InfoLog("(start) Device Status: %d\n", (int) * m_devStatus);
+    InfoLog("(bringUpDevice) Device Status: %d\n", (int) status);
     
     releaseAll();
     return true;
 }
 
-inline IOReturn Ath3KFirmware::getVendorState()
+inline IOReturn Ath3KFirmware::getVendorState(unsigned char * state)
 {
-    return sendVendorRequestIn(QCA_GET_STATUS, (void *) m_fwState, sizeof(char));
+    return sendVendorRequestIn(QCA_GET_STATUS, (void *) state, sizeof(char));
+}
+
+inline IOReturn Ath3KFirmware::getVendorVersion(Ath3KVersion * version)
+{
+    return sendVendorRequestIn(QCA_GET_VERSION, (void *) version, sizeof(Ath3KVersion));
+}
+
+/* Normal mode, patched and configured, all in the one state byte, and
+ * the version the device reports matches our record of the download.
+ */
+bool Ath3KFirmware::isProvisioned()
+{
+    const Ath3KDeviceState * devState = getDeviceState();
+    
+    if (!devState)
+    {
+        return false;
+    }
+    
+    if ((devState->state & ATH3K_MODE_MASK) != ATH3K_NORMAL_MODE || !(devState->state & QCA_PATCH_UPDATED) || !(devState->state & QCA_SYSCFG_UPDATED))
+    {
+        QCAProvisionCache::forget(m_pUSBDevice);
+        return false;
+    }
+    
+    return QCAProvisionCache::find(m_pUSBDevice, __le32_to_cpu(devState->version.romVersion), __le32_to_cpu(devState->version.buildVersion));
 }
 
-inline IOReturn Ath3KFirmware::getVendorVersion()
+/* GETSTATE and GETVERSION are separate vendor requests, there is no
+ * combined one. Both are read together and cached here until a download
+ * invalidates them, every caller in between reuses the pair.
+ */
+const Ath3KDeviceState * Ath3KFirmware::getDeviceState()
 {
-    return sendVendorRequestIn(QCA_GET_VERSION, (void *) m_fwVersion, sizeof(Ath3KVersion));
+    if (m_deviceState.valid)
+    {
+        return &m_deviceState;
+    }
+    
+    if (getVendorState(&m_deviceState.state))
+    {
+        ErrorLog("(getDeviceState) Unable to get vendor state!!!\n");
+        return NULL;
+    }
+    
+    if (getVendorVersion(&m_deviceState.version))
+    {
+        ErrorLog("(getDeviceState) Unable to get vendor version!!!\n");
+        return NULL;
+    }
+    
+    m_deviceState.valid = true;
+    return &m_deviceState;
 }
 
-inline IOReturn Ath3KFirmware::getDeviceStatus()
+inline IOReturn Ath3KFirmware::getDeviceStatus(USBStatus * status)
 {
-    return sendVendorRequestIn(kDeviceRequestGetStatus, (void *) m_devStatus, sizeof(uint16_t));
+    return sendVendorRequestIn(kDeviceRequestGetStatus, (void *) status, sizeof(uint16_t));
 }
 
 inline IOReturn Ath3KFirmware::switchPID()
 {
+    invalidateDeviceState();
     return sendVendorRequestIn(QCA_SWITCH_VID_PID, (void *) NULL, 0);
 }
 
 IOReturn Ath3KFirmware::setNormalMode()
 {
-    if (getVendorState())
+    const Ath3KDeviceState * devState = getDeviceState();
+    
+    if (!devState)
     {
-        ErrorLog("(setNormalMode) Unable to get vendor state!!!\n");
         return kIOReturnError;
     }
     
-    if ((* m_fwState & ATH3K_MODE_MASK) == ATH3K_NORMAL_MODE)
+    if ((devState->state & ATH3K_MODE_MASK) == ATH3K_NORMAL_MODE)
     {
         WarningLog("(setNormalMode) Firmware is already in normal mode!\n");
         return kIOReturnSuccess;
     }
     
+    invalidateDeviceState();
     return sendVendorRequestIn(QCA_NORMAL_MODE_SET, (void *) NULL, 0);
 }
 
 bool Ath3KFirmware::loadPatchRom()
 {
-    if (getVendorState())
-    {
-        ErrorLog("(loadPatchRom) Unable to get vendor state!!!\n");
-        
-        return false;
-    }
+    const Ath3KDeviceState * devState = getDeviceState();
     
-    if (getVendorVersion())
+    if (!devState)
     {
-        ErrorLog("(loadPatchRom) Unable to get vendor version!!!\n");
-        
         return false;
     }
     
-    if (* m_fwState & QCA_PATCH_UPDATED)
+    if (devState->state & QCA_PATCH_UPDATED)
     {
         WarningLog("(loadPatchRom) Firmware is already patched.\n");
         
         return true;
     }
     
-    snprintf(m_fwFilename, ATH3K_NAME_LEN, "AthrBT_0x%08x.dfu", __le32_to_cpu(m_fwVersion->romVersion));
+    snprintf(m_fwFilename, ATH3K_NAME_LEN, "AthrBT_0x%08x.dfu", __le32_to_cpu(devState->version.romVersion));
     
     DebugLog("Attempting to load patch rom file %s...\n", m_fwFilename);
     
@@ -198,7 +323,7 @@ bool Ath3KFirmware::loadPatchRom()
     UInt32 patchRomVersion      = get_unaligned_le32((char *) m_fwData->getBytesNoCopy() + m_fwData->getLength() - 8);
     UInt32 patchBuildVersion    = get_unaligned_le32((char *) m_fwData->getBytesNoCopy() + m_fwData->getLength() - 4);
     
-    if (patchRomVersion != __le32_to_cpu(m_fwVersion->romVersion) || patchBuildVersion <= __le32_to_cpu(m_fwVersion->buildVersion))
+    if (patchRomVersion != __le32_to_cpu(devState->version.romVersion) || patchBuildVersion <= __le32_to_cpu(devState->version.buildVersion))
     {
         ErrorLog("(loadPatchRom) Patch file version did not match firmware version!!!\n");
         
@@ -208,6 +333,9 @@ bool Ath3KFirmware::loadPatchRom()
         return false;
     }
     
+    /* The patch changes both state and version, whatever the outcome */
+    invalidateDeviceState();
+    
     if (loadFirmware(m_fwData, ATH3K_FW_HDR_SIZE))
     {
         DebugLog("Successfully loaded patch rom file %s...\n", m_fwFilename);
@@ -228,60 +356,46 @@ bool Ath3KFirmware::loadPatchRom()
     }
 }
 
-bool Ath3KFirmware::loadSysCfg()
+const char * Ath3KFirmware::findSysCfg(const Ath3KVersion * version)
 {
-    int clkValue;
+    u32 romVersion = __le32_to_cpu(version->romVersion);
     
-    if (getVendorState())
+    for (int i = 0; i < ARRAY_SIZE(Ath3KRampsTable); ++i)
     {
-        ErrorLog("(loadSysCfg) Unable to get vendor state!!!\n");
-        
-        return false;
+        if (Ath3KRampsTable[i].romVersion == romVersion && Ath3KRampsTable[i].refClock == version->refClock)
+        {
+            return Ath3KRampsTable[i].name;
+        }
     }
     
-    if (getVendorVersion())
+    ErrorLog("(findSysCfg) Unsupported rom 0x%08x with crystal %d, no system configuration!!!\n", romVersion, version->refClock);
+    return NULL;
+}
+
+bool Ath3KFirmware::loadSysCfg()
+{
+    const Ath3KDeviceState * devState = getDeviceState();
+    
+    if (!devState)
     {
-        ErrorLog("(loadSysCfg) Unable to get vendor version!!!\n");
-        
         return false;
     }
     
-    if (* m_fwState & QCA_SYSCFG_UPDATED)
+    if (devState->state & QCA_SYSCFG_UPDATED)
     {
         WarningLog("(loadSysCfg) System Configuration is already loaded.\n");
         
         return true;
     }
     
-    switch (m_fwVersion->refClock)
-    {
-    case ATH3K_XTAL_FREQ_26M:
+    if (!m_sysCfgName)
     {
-        clkValue = 26;
+        ErrorLog("(loadSysCfg) No system configuration for this device!!!\n");
         
-        break;
-    }
-    case ATH3K_XTAL_FREQ_40M:
-    {
-        clkValue = 40;
-        
-        break;
-    }
-    case ATH3K_XTAL_FREQ_19P2:
-    {
-        clkValue = 19;
-        
-        break;
-    }
-    default:
-    {
-        clkValue = 0;
-        
-        break;
-    }
+        return false;
     }
     
-    snprintf(m_fwFilename, ATH3K_NAME_LEN, "ramps_0x%08x_%d%s", __le32_to_cpu(m_fwVersion->romVersion), clkValue, ".dfu");
+    strlcpy(m_fwFilename, m_sysCfgName, ATH3K_NAME_LEN);
     
     DebugLog("Attempting to load system configuration file %s...\n", m_fwFilename);
     
@@ -294,6 +408,8 @@ bool Ath3KFirmware::loadSysCfg()
         return false;
     }
     
+    invalidateDeviceState();
+    
     if (loadFirmware(m_fwData, ATH3K_FW_HDR_SIZE))
     {
         DebugLog("Successfully loaded system configuration file: %s.\n", m_fwFilename);
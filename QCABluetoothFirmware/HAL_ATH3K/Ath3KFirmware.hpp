@@ -28,22 +28,58 @@
 #define Ath3KFirmware_hpp
 
 #include "QCABluetoothFirmware.hpp"
+#include "Ath3KReenumTracker.hpp"
+#include "QCAProvisionCache.hpp"
+
+/* Vendor state and version as last read from the device.
+ *
+ * Read together on first use and shared by every bring-up phase. Only
+ * requests that change the device (mode switch, downloads, PID switch)
+ * drop it, so unchanged state is never asked for twice.
+ */
+struct Ath3KDeviceState
+{
+    bool                    valid;
+    unsigned char           state;
+    Ath3KVersion            version;
+};
+
+/* Sysconfig for a ROM and crystal */
+struct Ath3KRampsEntry
+{
+    u32                     romVersion;
+    u8                      refClock;
+    const char          *   name;
+};
 
 class Ath3KFirmware : public QCABluetoothFirmware
 {
     OSDeclareDefaultStructors(Ath3KFirmware)
     
 public:
+    virtual IOService *     probe(
+                                IOService       *   provider,
+                                SInt32          *   score                   ) override;
     virtual bool            start(
                                 IOService       *   provider                ) override;
 protected:
-    IOReturn                getVendorState();
-    IOReturn                getVendorVersion();
-    IOReturn                getDeviceStatus();
+    virtual bool            isProvisioned() override;
+    virtual bool            bringUpDevice() override;
+    virtual QCABringUpState getLoadedState() override  { return QCA_BRINGUP_SWITCHED; }
+    IOReturn                getVendorState(unsigned char * state);
+    IOReturn                getVendorVersion(Ath3KVersion * version);
+    const Ath3KDeviceState * getDeviceState();
+    void                    invalidateDeviceState()     { m_deviceState.valid = false; }
+    IOReturn                getDeviceStatus(USBStatus * status);
     IOReturn                switchPID();
     IOReturn                setNormalMode();
     bool                    loadPatchRom();
+    const char          *   findSysCfg(const Ath3KVersion * version);
     bool                    loadSysCfg();
+    
+    Ath3KDeviceState        m_deviceState;
+    const char          *   m_sysCfgName;
+    u64                     m_probeTime;
 };
 
 #endif /* Ath3KFirmware_hpp */
@@ -0,0 +1,348 @@
+//
+//  Ath3KReenumTracker.cpp
+//  QCABluetoothFirmware
+//
+//  Copyright © 2021 cjiang. All rights reserved.
+//
+
+#include "Ath3KReenumTracker.hpp"
+#include "QCAModule.hpp"
+
+thread_call_t Ath3KReenumTracker::s_expireCall = NULL;
+Ath3KSwitchRecord Ath3KReenumTracker::s_records[ATH3K_MAX_SWITCHES];
+
+/* From the kext's start routine, before any driver can probe */
+bool Ath3KReenumTracker::init()
+{
+    s_expireCall = thread_call_allocate(expireTimer, NULL);
+
+    return s_expireCall != NULL;
+}
+
+/* From the kext's stop routine, no notifier may outlive the code it calls */
+void Ath3KReenumTracker::free()
+{
+    IONotifier * stale[ATH3K_MAX_SWITCHES];
+    u32 count = 0;
+
+    if (s_expireCall)
+    {
+        thread_call_cancel_wait(s_expireCall);
+    }
+
+    IOLockLock(g_pSharedLock);
+
+    for (int i = 0; i < ATH3K_MAX_SWITCHES; ++i)
+    {
+        if (s_records[i].notifier)
+        {
+            stale[count++] = s_records[i].notifier;
+        }
+        bzero(&s_records[i], sizeof(Ath3KSwitchRecord));
+    }
+
+    IOLockUnlock(g_pSharedLock);
+
+    while (count)
+    {
+        stale[--count]->remove();
+    }
+
+    if (s_expireCall)
+    {
+        thread_call_free(s_expireCall);
+        s_expireCall = NULL;
+    }
+}
+
+/* Call right before the switch, so a quick re-enumeration is not missed */
+void Ath3KReenumTracker::arm(IOUSBHostDevice * device, u64 probeTime)
+{
+    u32 locationID = getLocationID(device);
+    u16 vendorID = USBToHost16(device->getDeviceDescriptor()->idVendor);
+    u16 productID = USBToHost16(device->getDeviceDescriptor()->idProduct);
+    u64 now = mach_absolute_time();
+    IONotifier * stale[ATH3K_MAX_SWITCHES + 1];
+    Ath3KSwitchRecord * record;
+    OSDictionary * matching;
+    const OSSymbol * key;
+    OSNumber * value;
+    IONotifier * notifier;
+    u32 count;
+
+    if (!locationID)
+    {
+        ErrorLog("(arm) Unable to track re-enumeration!!!\n");
+        return;
+    }
+
+    IOLockLock(g_pSharedLock);
+
+    count = expireRecords(now, stale);
+
+    /* A device switched again takes its old slot */
+    if (!(record = findRecord(locationID)) && !(record = findRecord(0)))
+    {
+        IOLockUnlock(g_pSharedLock);
+        ErrorLog("(arm) Too many devices switching at once!!!\n");
+        return;
+    }
+
+    if (record->notifier)
+    {
+        stale[count++] = record->notifier;
+    }
+
+    record->locationID = locationID;
+    record->vendorID = vendorID;
+    record->productID = productID;
+    record->probeTime = probeTime;
+    record->switchTime = now;
+    record->notifier = NULL;
+
+    scheduleExpiry();
+
+    IOLockUnlock(g_pSharedLock);
+
+    while (count)
+    {
+        stale[--count]->remove();
+    }
+
+    key = OSSymbol::withCString(kUSBHostDevicePropertyLocationID);
+    value = OSNumber::withNumber(locationID, 32);
+    matching = IOService::serviceMatching("IOUSBHostDevice");
+
+    if (!key || !value || !matching || !IOService::propertyMatching(key, value, matching))
+    {
+        OSSafeReleaseNULL(key);
+        OSSafeReleaseNULL(value);
+        OSSafeReleaseNULL(matching);
+        ErrorLog("(arm) Failed to build matching dictionary!!!\n");
+        return;
+    }
+
+    /* Fires for the device as it is now as well, the handler skips that */
+    notifier = IOService::addMatchingNotification(gIOMatchedNotification, matching, matchedHandler, NULL, (void *)(uintptr_t) locationID);
+
+    OSSafeReleaseNULL(key);
+    OSSafeReleaseNULL(value);
+    OSSafeReleaseNULL(matching);
+
+    if (!notifier)
+    {
+        ErrorLog("(arm) Failed to install matching notification!!!\n");
+        return;
+    }
+
+    IOLockLock(g_pSharedLock);
+
+    if ((record = findRecord(locationID)))
+    {
+        record->notifier = notifier;
+        notifier = NULL;
+    }
+
+    IOLockUnlock(g_pSharedLock);
+
+    /* Already seen and released by the handler */
+    if (notifier)
+    {
+        notifier->remove();
+    }
+
+    DebugLog("(arm) Tracking %04x:%04x at 0x%08x through the PID switch.\n", vendorID, productID, locationID);
+}
+
+/* True for a device that came back from a switch on the same port */
+bool Ath3KReenumTracker::isReattach(IOUSBHostDevice * device)
+{
+    u32 locationID = getLocationID(device);
+    u16 productID = USBToHost16(device->getDeviceDescriptor()->idProduct);
+    u64 now = mach_absolute_time();
+    IONotifier * stale[ATH3K_MAX_SWITCHES + 1];
+    Ath3KSwitchRecord * record;
+    u64 switchTime = 0;
+    u32 count;
+
+    if (!locationID)
+    {
+        return false;
+    }
+
+    IOLockLock(g_pSharedLock);
+
+    count = expireRecords(now, stale);
+
+    if ((record = findRecord(locationID)) && record->productID != productID)
+    {
+        switchTime = record->switchTime;
+    }
+
+    IOLockUnlock(g_pSharedLock);
+
+    while (count)
+    {
+        stale[--count]->remove();
+    }
+
+    if (!switchTime)
+    {
+        return false;
+    }
+
+    InfoLog("(isReattach) %04x at 0x%08x is back after the PID switch (%llu ms), nothing to load.\n", productID, locationID, elapsedMs(switchTime, now));
+    return true;
+}
+
+bool Ath3KReenumTracker::matchedHandler(void * target, void * refCon, IOService * newService, IONotifier * notifier)
+{
+    IOUSBHostDevice * device = OSDynamicCast(IOUSBHostDevice, newService);
+    u32 locationID = (u32)(uintptr_t) refCon;
+    u64 now = mach_absolute_time();
+    IONotifier * stale[ATH3K_MAX_SWITCHES];
+    Ath3KSwitchRecord * record;
+    Ath3KSwitchRecord seen;
+    u16 productID;
+    u32 count;
+
+    if (!device)
+    {
+        return true;
+    }
+
+    productID = USBToHost16(device->getDeviceDescriptor()->idProduct);
+
+    IOLockLock(g_pSharedLock);
+
+    /* A device showing up on the port after the timeout is not the one that switched */
+    count = expireRecords(now, stale);
+
+    /* The device as it was before the switch */
+    if (!(record = findRecord(locationID)) || record->productID == productID)
+    {
+        IOLockUnlock(g_pSharedLock);
+
+        while (count)
+        {
+            stale[--count]->remove();
+        }
+        return true;
+    }
+
+    seen = * record;
+    bzero(record, sizeof(Ath3KSwitchRecord));
+
+    IOLockUnlock(g_pSharedLock);
+
+    while (count)
+    {
+        stale[--count]->remove();
+    }
+
+    /* NULL while arm is still installing it, arm removes it then */
+    if (seen.notifier)
+    {
+        seen.notifier->remove();
+    }
+
+    /* Matched, not yet HCI-ready: the Bluetooth stack still has to open it */
+    InfoLog("(matchedHandler) %04x:%04x re-attached as %04x, matched %llu ms after probe (%llu ms after the switch).\n", seen.vendorID, seen.productID, productID, elapsedMs(seen.probeTime, now), elapsedMs(seen.switchTime, now));
+
+    /* The driver that loaded it let go at the switch, so it is published here */
+    device->setProperty("QCAFirmwareLoadTime", elapsedMs(seen.probeTime, now), 32);
+    device->setProperty(QCA_FW_STATE_PROPERTY, "Ready");
+
+    return true;
+}
+
+/* Called with g_pSharedLock held */
+Ath3KSwitchRecord * Ath3KReenumTracker::findRecord(u32 locationID)
+{
+    for (int i = 0; i < ATH3K_MAX_SWITCHES; ++i)
+    {
+        if (s_records[i].locationID == locationID)
+        {
+            return &s_records[i];
+        }
+    }
+    return NULL;
+}
+
+/* Called with g_pSharedLock held, the notifiers returned in stale have to be
+ * removed once it is dropped.
+ */
+u32 Ath3KReenumTracker::expireRecords(u64 now, IONotifier ** stale)
+{
+    u32 count = 0;
+
+    for (int i = 0; i < ATH3K_MAX_SWITCHES; ++i)
+    {
+        if (s_records[i].locationID && elapsedMs(s_records[i].switchTime, now) >= ATH3K_REENUM_TIMEOUT)
+        {
+            ErrorLog("(expireRecords) Device at 0x%08x did not come back after the PID switch!!!\n", s_records[i].locationID);
+
+            if (s_records[i].notifier)
+            {
+                stale[count++] = s_records[i].notifier;
+            }
+            bzero(&s_records[i], sizeof(Ath3KSwitchRecord));
+        }
+    }
+
+    return count;
+}
+
+/* Called with g_pSharedLock held, times out the oldest record still waiting */
+void Ath3KReenumTracker::scheduleExpiry()
+{
+    u64 oldest = 0;
+    u64 interval;
+
+    for (int i = 0; i < ATH3K_MAX_SWITCHES; ++i)
+    {
+        if (s_records[i].locationID && (!oldest || s_records[i].switchTime < oldest))
+        {
+            oldest = s_records[i].switchTime;
+        }
+    }
+
+    if (oldest)
+    {
+        nanoseconds_to_absolutetime(ATH3K_REENUM_TIMEOUT * 1000000ULL, &interval);
+        thread_call_enter_delayed(s_expireCall, oldest + interval);
+    }
+}
+
+void Ath3KReenumTracker::expireTimer(thread_call_param_t param0, thread_call_param_t param1)
+{
+    IONotifier * stale[ATH3K_MAX_SWITCHES];
+    u32 count;
+
+    IOLockLock(g_pSharedLock);
+
+    count = expireRecords(mach_absolute_time(), stale);
+    scheduleExpiry();
+
+    IOLockUnlock(g_pSharedLock);
+
+    while (count)
+    {
+        stale[--count]->remove();
+    }
+}
+
+u32 Ath3KReenumTracker::getLocationID(IOService * device)
+{
+    OSNumber * locationID = OSDynamicCast(OSNumber, device->getProperty(kUSBHostDevicePropertyLocationID));
+
+    return locationID ? locationID->unsigned32BitValue() : 0;
+}
+
+u64 Ath3KReenumTracker::elapsedMs(u64 since, u64 now)
+{
+    u64 ns;
+
+    absolutetime_to_nanoseconds(now - since, &ns);
+    return ns / 1000000;
+}
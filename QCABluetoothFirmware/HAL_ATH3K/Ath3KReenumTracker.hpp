@@ -0,0 +1,60 @@
+//
+//  Ath3KReenumTracker.hpp
+//  QCABluetoothFirmware
+//
+//  Copyright © 2021 cjiang. All rights reserved.
+//
+
+#ifndef Ath3KReenumTracker_hpp
+#define Ath3KReenumTracker_hpp
+
+#include "QCABluetoothFirmware.hpp"
+#include <kern/thread_call.h>
+
+#define ATH3K_MAX_SWITCHES              4
+#define ATH3K_REENUM_TIMEOUT            10000   /* ms for the device to come back */
+
+/* A device that was told to switch its PID */
+struct Ath3KSwitchRecord
+{
+    u32                     locationID;         /* 0 if the slot is free */
+    u16                     vendorID;
+    u16                     productID;          /* before the switch */
+    u64                     probeTime;
+    u64                     switchTime;
+    IONotifier          *   notifier;
+};
+
+/* Follows an Ath3K through the PID switch.
+ *
+ * The port (locationID) stays the same when the device re-enumerates, so
+ * the identity recorded before the switch picks out the re-attached device
+ * from the matching notifications. Once a driver is matched to it, the
+ * time from probe is logged and published on the device. If this driver
+ * is offered the re-attached device itself, it steps aside without
+ * touching it. A device that does not come back within
+ * ATH3K_REENUM_TIMEOUT is forgotten and its notifier removed.
+ */
+class Ath3KReenumTracker
+{
+public:
+    static bool             init();
+    static void             free();
+
+    static void             arm(IOUSBHostDevice * device, u64 probeTime);
+    static bool             isReattach(IOUSBHostDevice * device);
+
+private:
+    static bool             matchedHandler(void * target, void * refCon, IOService * newService, IONotifier * notifier);
+    static void             expireTimer(thread_call_param_t param0, thread_call_param_t param1);
+    static Ath3KSwitchRecord * findRecord(u32 locationID);
+    static u32              expireRecords(u64 now, IONotifier ** stale);
+    static void             scheduleExpiry();
+    static u32              getLocationID(IOService * device);
+    static u64              elapsedMs(u64 since, u64 now);
+
+    static thread_call_t    s_expireCall;
+    static Ath3KSwitchRecord s_records[ATH3K_MAX_SWITCHES];
+};
+
+#endif /* Ath3KReenumTracker_hpp */
@@ -27,6 +27,92 @@
 #define super QCABluetoothFirmware
 OSDefineMetaClassAndStructors(QCAFirmware, QCABluetoothFirmware)
 
+/* Sorted by rom version for findDeviceInfo.
+ *
+ * Rome 1.x has no firmware in the catalog. The catalog's rampatch for Rome 2.1
+ * is a copy of the 2.0 one (it carries rom 0x0200), which the device would
+ * refuse, so 2.1 is left out as well.
+ *
+ * WCN6855 uses this same path, with 40 byte rampatch headers and the version
+ * at 16 ({ 0x00130100, 40, 4, 16 } and { 0x00130200, 40, 4, 16 }). Its rows
+ * can go in once rampatch_usb_00130x00.bin and nvm_usb_00130x00.bin are in
+ * the catalog; the check below keeps them out until then.
+ */
+static constexpr QCADeviceInfo QCADevicesTable[] =
+{
+    { 0x00000200, 28, 4, 16, "rampatch_usb_00000200.bin", "nvm_usb_00000200.bin" },      /* Rome 2.0 */
+    { 0x00000300, 28, 4, 16, "rampatch_usb_00000300.bin", "nvm_usb_00000300.bin" },      /* Rome 3.0 */
+    { 0x00000302, 28, 4, 16, "rampatch_usb_00000302.bin", "nvm_usb_00000302.bin" },      /* Rome 3.2 */
+};
+
+/* Both files present and the headers shorter than the files. The blobs
+ * themselves are not constant expressions, so the rom version inside the
+ * rampatch is only checked by loadRamPatch.
+ */
+static constexpr bool isValidDeviceInfo(const QCADeviceInfo & info)
+{
+    const FwDesc * rampatch = findFwDesc(info.rampatch);
+    const FwDesc * nvm = findFwDesc(info.nvm);
+    
+    if (!rampatch || !nvm)
+    {
+        return false;
+    }
+    
+    return info.ramPatchHdr < rampatch->size && info.nvmHdr < nvm->size && info.versionOffset + sizeof(QCARamPatchVersion) <= info.ramPatchHdr;
+}
+
+static constexpr bool isValidDevicesTable()
+{
+    for (size_t i = 0; i < ARRAY_SIZE(QCADevicesTable); ++i)
+    {
+        if (!isValidDeviceInfo(QCADevicesTable[i]) || (i && QCADevicesTable[i - 1].romVersion >= QCADevicesTable[i].romVersion))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static_assert(isValidDevicesTable(), "QCADevicesTable is unsorted or names files missing from the firmware catalog");
+
+IOService * QCAFirmware::probe(IOService * provider, SInt32 * score)
+{
+    IOUSBHostDevice * device = OSDynamicCast(IOUSBHostDevice, provider);
+    QCAVersion version;
+    IOReturn ret;
+    
+    if (!super::probe(provider, score) || !isQcaUsb() || !device)
+    {
+        return NULL;
+    }
+    
+    /* Ask the rom before anything is configured, unknown ones are left alone */
+    m_pUSBDevice = device;
+    ret = sendVendorRequestIn(QCA_GET_VERSION, &version, sizeof(QCAVersion));
+    m_pUSBDevice = NULL;
+    
+    if (ret)
+    {
+        ErrorLog("(probe) Failed to read rom version!!!\n");
+        return NULL;
+    }
+    
+    if (!findDeviceInfo(le32_to_cpu(version.romVersion)))
+    {
+        if (m_socType == QCA_WCN6855)
+        {
+            ErrorLog("(probe) No WCN6855 firmware in the catalog (rom 0x%08x), leaving the device alone!!!\n", le32_to_cpu(version.romVersion));
+            return NULL;
+        }
+        
+        ErrorLog("(probe) Unsupported rom version 0x%08x!!!\n", le32_to_cpu(version.romVersion));
+        return NULL;
+    }
+    
+    return this;
+}
+
 bool QCAFirmware::start(IOService * provider) //TO-DO!!!
 {
     if (!isQcaUsb())
@@ -67,55 +153,169 @@ bool QCAFirmware::start(IOService * provider) //TO-DO!!!
     
     DebugLog("(start) Device successfully reset.\n");
     
+    if (!m_fwState)
+    {
+        m_fwState = new unsigned char;
+    }
+    
+    if (!m_fwVersion)
+    {
+        m_fwVersion = new QCAVersion;
+    }
+    
+    if (!m_fwState || !m_fwVersion)
+    {
+        ErrorLog("(start) Failed to allocate firmware state!!!\n");
+        return false;
+    }
     
+    /* A warm re-probe ends here, after a state and a version read */
+    if (isProvisioned())
+    {
+        InfoLog("(start) Firmware is already loaded.\n");
+        setBringUpState(QCA_BRINGUP_READY);
+        return true;
+    }
+    
+    /* The downloads run off the matching thread */
+    return startBringUp();
+}
+
+bool QCAFirmware::bringUpDevice()
+{
     if (getFirmwareVersion())
     {
-        ErrorLog("(start) Failed to send vendor request!!!\n");
+        ErrorLog("(bringUpDevice) Failed to send vendor request!!!\n");
         return false;
     }
 
     
-    getDeviceInfo();
-    
-    if (!m_devInfo)
+    /* Checked in probe already, unless the device changed in between */
+    if (!(m_devInfo = findDeviceInfo(le32_to_cpu(m_fwVersion->romVersion))))
     {
-        ErrorLog("(start) Provider does not support firmware rome version 0x%x!", le32_to_cpu(m_fwVersion->romVersion));
+        ErrorLog("(bringUpDevice) Provider does not support firmware rome version 0x%x!", le32_to_cpu(m_fwVersion->romVersion));
         
         //releaseAll();
         
         return false;
     }
 
-    if (getFirmwareState())
+    if (!initUSBConfiguration())
     {
-        ErrorLog("(start) Failed to send vendor request!!!\n");
+        ErrorLog("(bringUpDevice) Failed to initialize USB configuration!!!\n");
         return false;
     }
-
+    
+    if (!initInterface())
+    {
+        ErrorLog("(bringUpDevice) Failed to initialize interface!!!\n");
+        return false;
+    }
+    
+    /* isProvisioned left the state it read */
+    bool nvmPending = !(* m_fwState & QCA_SYSCFG_UPDATED);
+    
+    if (nvmPending)
+    {
+        startNVMPrepare();
+    }
+    
     if (!(* m_fwState & QCA_PATCH_UPDATED))
     {
         if (!loadRamPatch())
         {
-            ErrorLog("(start) Failed to load ram patch file!!!");
+            ErrorLog("(bringUpDevice) Failed to load ram patch file!!!");
+            releaseNVMPrepare();
             return false;
         }
     }
 
     if (getFirmwareVersion())
     {
-        ErrorLog("(start) Failed to send vendor request!!!\n");
+        ErrorLog("(bringUpDevice) Failed to send vendor request!!!\n");
+        releaseNVMPrepare();
         return false;
     }
 
-    if (!(* m_fwState & QCA_SYSCFG_UPDATED))
+    if (nvmPending)
     {
+        char nvmFilename[sizeof(m_nvmFilename)];
+        
+        /* The board id can read differently once the patch runs, the
+         * prepared NVM is only good if it still names the same file.
+         */
+        getNVMUSBName(nvmFilename, sizeof(nvmFilename));
+        
+        if (strncmp(nvmFilename, m_nvmFilename, sizeof(nvmFilename)))
+        {
+            InfoLog("(bringUpDevice) NVM changed from %s to %s after the ram patch.\n", m_nvmFilename, nvmFilename);
+            
+            releaseNVMPrepare();
+            strlcpy(m_nvmFilename, nvmFilename, sizeof(m_nvmFilename));
+            
+            m_nvmReady = prepareNVM();
+            m_nvmDone = true;
+        }
+        
         if (!loadNVM())
         {
-            ErrorLog("(start) Failed to load NVM file!!!");
+            ErrorLog("(bringUpDevice) Failed to load NVM file!!!");
+            releaseNVMPrepare();
             return false;
         }
+        
+        releaseNVMPrepare();
     }
+    
+    /* Recorded as the device reports it with the patch running, which is
+     * what isProvisioned compares against on the next probe.
+     */
+    if (!getFirmwareVersion())
+    {
+        QCAProvisionCache::save(m_pUSBDevice, le32_to_cpu(m_fwVersion->romVersion), le32_to_cpu(m_fwVersion->patchVersion));
+    }
+
+    return true;
+}
 
+/* Both state bits set and a record of our own download on this port,
+ * with the version the device reports still matching it. The USB vendor
+ * interface has no request returning state and version together, so a
+ * patched device costs two reads, an unpatched one stops after the state.
+ */
+bool QCAFirmware::isProvisioned()
+{
+    u32 romVersion, patchVersion;
+    
+    if (getFirmwareState())
+    {
+        ErrorLog("(isProvisioned) Failed to read firmware state!!!\n");
+        
+        /* Load everything, the download will tell if the device is gone */
+        * m_fwState = 0;
+        return false;
+    }
+    
+    if ((* m_fwState & (QCA_PATCH_UPDATED | QCA_SYSCFG_UPDATED)) != (QCA_PATCH_UPDATED | QCA_SYSCFG_UPDATED))
+    {
+        QCAProvisionCache::forget(m_pUSBDevice);
+        return false;
+    }
+    
+    if (getFirmwareVersion())
+    {
+        return false;
+    }
+    
+    romVersion = le32_to_cpu(m_fwVersion->romVersion);
+    patchVersion = le32_to_cpu(m_fwVersion->patchVersion);
+    
+    if (!QCAProvisionCache::find(m_pUSBDevice, romVersion, patchVersion))
+    {
+        return false;
+    }
+    
+    DebugLog("(isProvisioned) Running rom 0x%08x with patch 0x%08x.\n", romVersion, patchVersion);
     return true;
 }
 
@@ -131,53 +331,56 @@ inline IOReturn QCAFirmware::getFirmwareState()
 
 inline bool QCAFirmware::getRamPatchVersion()
 {
-    m_rpVersion = (QCARamPatchVersion *) (m_fwData + m_devInfo->versionOffset);
-    if (m_rpVersion)
+    if (m_fwData->getLength() < m_devInfo->versionOffset + sizeof(QCARamPatchVersion))
     {
-        return true;
+        m_rpVersion = NULL;
+        return false;
     }
-    return false;
+    
+    m_rpVersion = (QCARamPatchVersion *) ((const u8 *) m_fwData->getBytesNoCopy() + m_devInfo->versionOffset);
+    return true;
 }
 
-bool QCAFirmware::getDeviceInfo()
+const QCADeviceInfo * QCAFirmware::findDeviceInfo(u32 romVersion)
 {
-    static QCADeviceInfo QCADevicesTable[] =
-    {
-        { 0x00000100, 20, 4,  8 },      /* Rome 1.0 */
-        { 0x00000101, 20, 4,  8 },      /* Rome 1.1 */
-        { 0x00000200, 28, 4, 16 },      /* Rome 2.0 */
-        { 0x00000201, 28, 4, 16 },      /* Rome 2.1 */
-        { 0x00000300, 28, 4, 16 },      /* Rome 3.0 */
-        { 0x00000302, 28, 4, 16 },      /* Rome 3.2 */
-        { 0x00130100, 40, 4, 16 },      /* WCN6855 1.0 */
-        { 0x00130200, 40, 4, 16 },      /* WCN6855 2.0 */
-    };
+    size_t low = 0, high = ARRAY_SIZE(QCADevicesTable);
     
-    for (int i = 0; i < ARRAY_SIZE(QCADevicesTable); ++i)
+    while (low < high)
     {
-        if (le32_to_cpu(m_fwVersion->romVersion) == QCADevicesTable[i].romVersion)
+        size_t mid = (low + high) / 2;
+        
+        if (QCADevicesTable[mid].romVersion == romVersion)
+        {
+            return &QCADevicesTable[mid];
+        }
+        
+        if (QCADevicesTable[mid].romVersion < romVersion)
+        {
+            low = mid + 1;
+        }
+        else
         {
-            m_devInfo = &QCADevicesTable[i];
-            return true;
+            high = mid;
         }
     }
-    return false;
+    return NULL;
 }
 
 void QCAFirmware::getRamPatchUSBName()
 {
-    snprintf(m_fwFilename, sizeof(m_fwFilename), "rampatch_usb_%08x.bin", le32_to_cpu(m_fwVersion->romVersion));
+    strlcpy(m_fwFilename, m_devInfo->rampatch, sizeof(m_fwFilename));
 }
 
-void QCAFirmware::getNVMUSBName()
+void QCAFirmware::getNVMUSBName(char * name, size_t size)
 {
-    if (((m_fwVersion->flag >> 8) & 0xff) == QCA_FLAG_MULTI_NVM)
+    /* Board 0 of a multi NVM part (e.g. WCN6855) uses the default NVM */
+    if (((m_fwVersion->flag >> 8) & 0xff) == QCA_FLAG_MULTI_NVM && m_fwVersion->boardId)
     {
-        snprintf(m_fwFilename, sizeof(m_fwFilename), "nvm_usb_%08x_%04x.bin", le32_to_cpu(m_fwVersion->romVersion), le16_to_cpu(m_fwVersion->boardId));
+        snprintf(name, size, "nvm_usb_%08x_%04x.bin", le32_to_cpu(m_fwVersion->romVersion), le16_to_cpu(m_fwVersion->boardId));
     }
     else
     {
-        snprintf(m_fwFilename, sizeof(m_fwFilename), "nvm_usb_%08x.bin", le32_to_cpu(m_fwVersion->romVersion));
+        strlcpy(name, m_devInfo->nvm, size);
     }
 }
 
@@ -199,7 +402,13 @@ bool QCAFirmware::loadRamPatch()
 
     InfoLog("(loadRamPatch) Using ram patch file: %s.", m_fwFilename);
     
-    getRamPatchVersion();
+    if (!getRamPatchVersion())
+    {
+        ErrorLog("(loadRamPatch) Ram patch file is too short!!!\n");
+        
+        OSSafeReleaseNULL(m_fwData);
+        return false;
+    }
     
     u16 rpRomVersionLow = le16_to_cpu(m_rpVersion->romVersionLow);
     u16 rpPatchVersion = le16_to_cpu(m_rpVersion->patchVersion);
@@ -250,32 +459,127 @@ bool QCAFirmware::loadRamPatch()
 
 bool QCAFirmware::loadNVM()
 {
-    getNVMUSBName();
-    
-    m_fwData = getFwDescByName(m_fwFilename);
-    
-    if (!m_fwData)
+    if (!finishNVMPrepare())
     {
-        ErrorLog("(loadNvmUSB) Failed to request NVM file: %s!!!\n", m_fwFilename);
         return false;
     }
 
-    InfoLog("(loadNvmUSB) Using NVM file: %s.", m_fwFilename);
+    if (loadFirmware(&m_nvmImage))
+    {
+        DebugLog("Successfully loaded NVM USB file: %s.\n", m_nvmFilename);
+        return true;
+    }
+    
+    ErrorLog("Failed to load NVM USB file: %s!!!\n", m_nvmFilename);
+    return false;
+}
+
+/* The name comes from the version read before the rampatch, bringUpDevice
+ * checks it against the one read after. The rest is left to the thread call.
+ */
+void QCAFirmware::startNVMPrepare()
+{
+    getNVMUSBName(m_nvmFilename, sizeof(m_nvmFilename));
+    
+    m_nvmDone = false;
+    m_nvmReady = false;
+    bzero(&m_nvmImage, sizeof(QCAFirmwareImage));
+    
+    m_nvmLock = IOLockAlloc();
+    m_nvmCall = thread_call_allocate(prepareNVMCall, this);
+    
+    if (!m_nvmLock || !m_nvmCall)
+    {
+        WarningLog("(startNVMPrepare) Preparing NVM in line!\n");
+        
+        m_nvmReady = prepareNVM();
+        m_nvmDone = true;
+        return;
+    }
+    
+    thread_call_enter(m_nvmCall);
+}
 
-    if (loadFirmware(m_fwData, m_devInfo->nvmHdr))
+bool QCAFirmware::finishNVMPrepare()
+{
+    if (m_nvmLock)
     {
-        DebugLog("Successfully loaded NVM USB file: %s.\n", m_fwFilename);
+        IOLockLock(m_nvmLock);
         
-        m_fwData->free();
-        m_fwData = NULL;
+        while (!m_nvmDone)
+        {
+            IOLockSleep(m_nvmLock, &m_nvmDone, THREAD_UNINT);
+        }
         
-        return true;
+        IOLockUnlock(m_nvmLock);
     }
     
-    ErrorLog("Failed to load NVM USB file: %s!!!\n", m_fwFilename);
+    return m_nvmReady;
+}
+
+/* Safe on every path out of start, waits for the thread call first */
+void QCAFirmware::releaseNVMPrepare()
+{
+    finishNVMPrepare();
+    releaseFirmware(&m_nvmImage);
     
-    m_fwData->free();
-    m_fwData = NULL;
+    if (m_nvmCall)
+    {
+        thread_call_free(m_nvmCall);
+        m_nvmCall = NULL;
+    }
     
-    return false;
+    if (m_nvmLock)
+    {
+        IOLockFree(m_nvmLock);
+        m_nvmLock = NULL;
+    }
+}
+
+void QCAFirmware::prepareNVMCall(thread_call_param_t param0, thread_call_param_t param1)
+{
+    QCAFirmware * that = (QCAFirmware *) param0;
+    bool ready = that->prepareNVM();
+    
+    IOLockLock(that->m_nvmLock);
+    
+    that->m_nvmReady = ready;
+    that->m_nvmDone = true;
+    IOLockWakeup(that->m_nvmLock, &that->m_nvmDone, false);
+    
+    IOLockUnlock(that->m_nvmLock);
+}
+
+/* Touches neither the device nor anything the rampatch download uses */
+bool QCAFirmware::prepareNVM()
+{
+    OSData * nvm = getFwDescByName(m_nvmFilename);
+    const u8 * hdr;
+    u32 length;
+    bool ret;
+    
+    if (!nvm)
+    {
+        ErrorLog("(prepareNVM) Failed to request NVM file: %s!!!\n", m_nvmFilename);
+        return false;
+    }
+
+    InfoLog("(prepareNVM) Using NVM file: %s.", m_nvmFilename);
+    
+    /* There is no checksum, but the header has to account for the whole file */
+    hdr = (const u8 *) nvm->getBytesNoCopy();
+    length = nvm->getLength() > QCA_USB_NVM_HDR_SIZE ? hdr[1] | hdr[2] << 8 | hdr[3] << 16 : 0;
+    
+    if (m_devInfo->nvmHdr != QCA_USB_NVM_HDR_SIZE || !length || hdr[0] != QCA_USB_NVM_TYPE || length != nvm->getLength() - QCA_USB_NVM_HDR_SIZE)
+    {
+        ErrorLog("(prepareNVM) NVM file %s is corrupt!!!\n", m_nvmFilename);
+        
+        OSSafeReleaseNULL(nvm);
+        return false;
+    }
+    
+    ret = prepareFirmware(nvm, m_devInfo->nvmHdr, &m_nvmImage);
+    
+    OSSafeReleaseNULL(nvm);
+    return ret;
 }
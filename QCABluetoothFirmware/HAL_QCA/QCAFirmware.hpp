@@ -26,24 +26,48 @@
 #define QCAFirmware_hpp
 
 #include "QCABluetoothFirmware.hpp"
+#include "QCAProvisionCache.hpp"
+#include <kern/thread_call.h>
+
+#define QCA_USB_NVM_TYPE                0x02    /* first byte of an NVM, a 24 bit length follows */
+#define QCA_USB_NVM_HDR_SIZE            4
 
 class QCAFirmware : public QCABluetoothFirmware
 {
     OSDeclareDefaultStructors(QCAFirmware)
     
 public:
+    virtual IOService * probe( IOService * provider, SInt32 * score ) override;
     virtual bool start( IOService * provider ) override;
     
+protected:
+    virtual bool isProvisioned() override;
+    virtual bool bringUpDevice() override;
+    
 private:
     IOReturn getFirmwareState();
     IOReturn getFirmwareVersion();
     bool getRamPatchVersion();
-    bool getDeviceInfo();
+    static const QCADeviceInfo * findDeviceInfo(u32 romVersion);
     
     void getRamPatchUSBName();
-    void getNVMUSBName();
+    void getNVMUSBName(char * name, size_t size);
     bool loadRamPatch();
     bool loadNVM();
+    
+    static void prepareNVMCall(thread_call_param_t param0, thread_call_param_t param1);
+    void startNVMPrepare();
+    bool finishNVMPrepare();
+    void releaseNVMPrepare();
+    bool prepareNVM();
+    
+    /* The NVM is made ready on a thread call while the rampatch streams */
+    thread_call_t m_nvmCall;
+    IOLock * m_nvmLock;
+    bool m_nvmDone;
+    bool m_nvmReady;
+    QCAFirmwareImage m_nvmImage;
+    char m_nvmFilename[64];
 };
 
 #endif /* QCAFirmware_hpp */
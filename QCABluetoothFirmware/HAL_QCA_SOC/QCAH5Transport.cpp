@@ -0,0 +1,544 @@
+//
+//  QCAH5Transport.cpp
+//  QCABluetoothFirmware
+//
+//  Copyright © 2021 cjiang. All rights reserved.
+//
+
+#include "QCAH5Transport.hpp"
+
+static const u8 H5Sync[]        = { 0x01, 0x7e };
+static const u8 H5SyncRsp[]     = { 0x02, 0x7d };
+static const u8 H5Config[]      = { 0x03, 0xfc };
+static const u8 H5ConfigRsp[]   = { 0x04, 0x7b };
+
+/* CRC-CCITT computed LSB first, sent bit reversed and MSB first */
+static u16 h5Crc(const u8 * data, u32 len)
+{
+    u16 crc = 0xffff;
+    u16 rev = 0;
+
+    while (len--)
+    {
+        crc ^= *data++;
+        for (int i = 0; i < 8; ++i)
+        {
+            crc = (crc & 1) ? (crc >> 1) ^ 0x8408 : crc >> 1;
+        }
+    }
+
+    for (int i = 0; i < 16; ++i)
+    {
+        rev = (rev << 1) | ((crc >> i) & 1);
+    }
+
+    return rev;
+}
+
+QCAH5Transport::QCAH5Transport(IOSerialStreamSync * stream, OSObject * owner, HciEventAction action, u8 window) : QCAUartTransport(stream, owner, action)
+{
+    m_pWriteLock = IOLockAlloc();
+    m_retransmitCall = thread_call_allocate(retransmitTimer, this);
+
+    m_state = H5_UNINITIALIZED;
+    m_window = window && window <= H5_MAX_WINDOW ? window : H5_DEFAULT_WINDOW;
+    m_txWindow = 1;
+    m_useCrc = false;
+
+    m_txSeq = m_txAck = m_rxSeq = 0;
+    m_retransmits = 0;
+    m_rtxBusy = false;
+
+    m_rxEscape = false;
+    m_rxDiscard = true;
+    m_rxFrameLen = 0;
+}
+
+QCAH5Transport::~QCAH5Transport()
+{
+    close();
+
+    if (m_retransmitCall)
+    {
+        thread_call_free(m_retransmitCall);
+        m_retransmitCall = NULL;
+    }
+
+    if (m_pWriteLock)
+    {
+        IOLockFree(m_pWriteLock);
+        m_pWriteLock = NULL;
+    }
+}
+
+bool QCAH5Transport::open(u32 speed)
+{
+    if (!m_pWriteLock || !m_retransmitCall)
+    {
+        return false;
+    }
+
+    m_state = H5_UNINITIALIZED;
+    m_txSeq = m_txAck = m_rxSeq = 0;
+    m_retransmits = 0;
+
+    /* Everything up to the first delimiter is noise */
+    m_rxEscape = false;
+    m_rxDiscard = true;
+    m_rxFrameLen = 0;
+
+    if (!QCAUartTransport::open(speed))
+    {
+        return false;
+    }
+
+    if (!establishLink())
+    {
+        QCAUartTransport::close();
+        return false;
+    }
+
+    return true;
+}
+
+void QCAH5Transport::close()
+{
+    if (m_retransmitCall)
+    {
+        thread_call_cancel_wait(m_retransmitCall);
+    }
+
+    if (m_pLock)
+    {
+        IOLockLock(m_pLock);
+        m_state = H5_UNINITIALIZED;
+        IOLockWakeup(m_pLock, &m_txAck, false);
+        IOLockUnlock(m_pLock);
+    }
+
+    QCAUartTransport::close();
+}
+
+bool QCAH5Transport::establishLink()
+{
+    u8 config[sizeof(H5Config) + 1];
+
+    memcpy(config, H5Config, sizeof(H5Config));
+    config[sizeof(H5Config)] = getConfig();
+
+    if (!sendLinkMessage(H5_INITIALIZED, H5Sync, sizeof(H5Sync)))
+    {
+        ErrorLog("(establishLink) No SYNC response from controller!!!\n");
+        return false;
+    }
+
+    if (!sendLinkMessage(H5_ACTIVE, config, sizeof(config)))
+    {
+        ErrorLog("(establishLink) No CONFIG response from controller!!!\n");
+        return false;
+    }
+
+    InfoLog("(establishLink) H5 link active (window: %d, crc: %d).\n", m_txWindow, m_useCrc);
+
+    return true;
+}
+
+/* Repeats msg every H5_SYNC_INTERVAL until the link reaches state */
+bool QCAH5Transport::sendLinkMessage(H5LinkState until, const u8 * msg, u16 len)
+{
+    UInt64 deadline, retry;
+
+    clock_interval_to_deadline(H5_LINK_TIMEOUT, kMillisecondScale, &deadline);
+
+    IOLockLock(m_pLock);
+
+    while (m_state < until)
+    {
+        IOLockUnlock(m_pLock);
+        writeFrame(H5_LINK_CTL_PKT, false, 0, msg, len);
+        IOLockLock(m_pLock);
+
+        clock_interval_to_deadline(H5_SYNC_INTERVAL, kMillisecondScale, &retry);
+
+        if (m_state < until && IOLockSleepDeadline(m_pLock, &m_state, retry < deadline ? retry : deadline, THREAD_UNINT) == THREAD_TIMED_OUT && retry >= deadline)
+        {
+            break;
+        }
+    }
+
+    bool reached = m_state >= until;
+
+    IOLockUnlock(m_pLock);
+
+    return reached;
+}
+
+void QCAH5Transport::handleLinkControl(const u8 * data, u16 len)
+{
+    u8 config[sizeof(H5ConfigRsp) + 1];
+
+    if (len < 2)
+    {
+        return;
+    }
+
+    if (!memcmp(data, H5Sync, sizeof(H5Sync)))
+    {
+        if (m_state == H5_ACTIVE)
+        {
+            ErrorLog("(handleLinkControl) Controller restarted the link!!!\n");
+        }
+        writeFrame(H5_LINK_CTL_PKT, false, 0, H5SyncRsp, sizeof(H5SyncRsp));
+    }
+    else if (!memcmp(data, H5Config, sizeof(H5Config)))
+    {
+        memcpy(config, H5ConfigRsp, sizeof(H5ConfigRsp));
+        config[sizeof(H5ConfigRsp)] = getConfig();
+        writeFrame(H5_LINK_CTL_PKT, false, 0, config, sizeof(config));
+    }
+    else if (!memcmp(data, H5SyncRsp, sizeof(H5SyncRsp)))
+    {
+        IOLockLock(m_pLock);
+        if (m_state == H5_UNINITIALIZED)
+        {
+            m_state = H5_INITIALIZED;
+            IOLockWakeup(m_pLock, &m_state, false);
+        }
+        IOLockUnlock(m_pLock);
+    }
+    else if (!memcmp(data, H5ConfigRsp, sizeof(H5ConfigRsp)))
+    {
+        IOLockLock(m_pLock);
+        if (m_state == H5_INITIALIZED)
+        {
+            /* A response without a configuration field means window 1, no CRC */
+            u8 peer = len > sizeof(H5ConfigRsp) ? data[sizeof(H5ConfigRsp)] : 1;
+
+            m_txWindow = min(m_window, max(peer & H5_CFG_WINDOW_MASK, 1));
+            m_useCrc = peer & H5_CFG_CRC;
+            m_state = H5_ACTIVE;
+            IOLockWakeup(m_pLock, &m_state, false);
+        }
+        IOLockUnlock(m_pLock);
+    }
+}
+
+IOReturn QCAH5Transport::sendCommand(const HciCommandHdr * cmd, UInt32 timeout)
+{
+    u16 len = HCI_COMMAND_HDR_SIZE + cmd->plen;
+    H5TxPacket * packet;
+    UInt64 deadline;
+    bool idle;
+    u8 seq;
+
+    clock_interval_to_deadline(timeout, kMillisecondScale, &deadline);
+
+    IOLockLock(m_pLock);
+
+    /* Wait for room in the window */
+    while (m_state == H5_ACTIVE && getUnacked() >= m_txWindow)
+    {
+        if (IOLockSleepDeadline(m_pLock, &m_txAck, deadline, THREAD_UNINT) == THREAD_TIMED_OUT)
+        {
+            IOLockUnlock(m_pLock);
+            ErrorLog("(sendCommand) Window stayed full for %u ms!!!\n", (unsigned int) timeout);
+            return kIOReturnTimeout;
+        }
+    }
+
+    if (m_state != H5_ACTIVE)
+    {
+        IOLockUnlock(m_pLock);
+        return kIOReturnNotReady;
+    }
+
+    seq = m_txSeq;
+    packet = &m_txQueue[seq];
+    packet->type = H4_CMD_PKT;
+    packet->len = len;
+    memcpy(packet->data, cmd, len);
+
+    idle = !getUnacked();
+    m_txSeq = (m_txSeq + 1) & (H5_SEQ_COUNT - 1);
+
+    IOLockUnlock(m_pLock);
+
+    if (idle)
+    {
+        armRetransmit();
+    }
+
+    return writeFrame(packet->type, true, seq, packet->data, packet->len);
+}
+
+void QCAH5Transport::armRetransmit()
+{
+    UInt64 deadline;
+
+    clock_interval_to_deadline(H5_RETRANSMIT_TIME, kMillisecondScale, &deadline);
+    thread_call_enter_delayed(m_retransmitCall, deadline);
+}
+
+void QCAH5Transport::retransmitTimer(thread_call_param_t param0, thread_call_param_t param1)
+{
+    QCAH5Transport * that = (QCAH5Transport *) param0;
+    H5TxPacket * packet;
+    u8 seq, first, count = 0;
+
+    IOLockLock(that->m_pLock);
+
+    if (that->m_state != H5_ACTIVE || !that->getUnacked() || that->m_rtxBusy)
+    {
+        IOLockUnlock(that->m_pLock);
+        return;
+    }
+
+    if (++that->m_retransmits > H5_MAX_RETRANSMITS)
+    {
+        ErrorLog("(retransmitTimer) Controller stopped acknowledging, link is down!!!\n");
+        that->m_state = H5_UNINITIALIZED;
+        IOLockWakeup(that->m_pLock, &that->m_txAck, false);
+        IOLockUnlock(that->m_pLock);
+        return;
+    }
+
+    DebugLog("(retransmitTimer) Resending %d packet(s) from seq %d.\n", that->getUnacked(), that->m_txAck);
+
+    /* Copied out so that the writes below do not hold up the read path,
+     * which needs m_pLock to take the acknowledgements.
+     */
+    first = that->m_txAck;
+    for (seq = first; seq != that->m_txSeq; seq = (seq + 1) & (H5_SEQ_COUNT - 1))
+    {
+        packet = &that->m_rtxQueue[count++];
+        packet->type = that->m_txQueue[seq].type;
+        packet->len = that->m_txQueue[seq].len;
+        memcpy(packet->data, that->m_txQueue[seq].data, packet->len);
+    }
+    that->m_rtxBusy = true;
+
+    IOLockUnlock(that->m_pLock);
+
+    for (u8 i = 0; i < count; ++i)
+    {
+        packet = &that->m_rtxQueue[i];
+        that->writeFrame(packet->type, true, (first + i) & (H5_SEQ_COUNT - 1), packet->data, packet->len);
+    }
+
+    IOLockLock(that->m_pLock);
+    that->m_rtxBusy = false;
+    IOLockUnlock(that->m_pLock);
+
+    that->armRetransmit();
+}
+
+IOReturn QCAH5Transport::writeFrame(u8 type, bool reliable, u8 seq, const u8 * data, u16 len)
+{
+    u8 * hdr = m_txFrame;
+    u32 frameLen = H5_HDR_SIZE + len;
+    u32 slipLen = 0;
+    u16 crc;
+    u8 ack;
+    bool useCrc;
+    IOReturn ret;
+
+    IOLockLock(m_pWriteLock);
+
+    /* The read path moves both on, the write lock goes first */
+    IOLockLock(m_pLock);
+    ack = m_rxSeq;
+    useCrc = m_useCrc;
+    IOLockUnlock(m_pLock);
+
+    /* Link establishment always goes without CRC */
+    useCrc = useCrc && type != H5_LINK_CTL_PKT;
+
+    hdr[0] = (ack << 3) | (useCrc ? 0x40 : 0);
+    if (reliable)
+    {
+        hdr[0] |= 0x80 | seq;
+    }
+    hdr[1] = type | ((len & 0x0f) << 4);
+    hdr[2] = len >> 4;
+    hdr[3] = ~(hdr[0] + hdr[1] + hdr[2]);
+
+    if (len)
+    {
+        memcpy(m_txFrame + H5_HDR_SIZE, data, len);
+    }
+
+    if (useCrc)
+    {
+        crc = h5Crc(m_txFrame, frameLen);
+        m_txFrame[frameLen++] = crc >> 8;
+        m_txFrame[frameLen++] = crc & 0xff;
+    }
+
+    m_txSlip[slipLen++] = SLIP_DELIMITER;
+    for (u32 i = 0; i < frameLen; ++i)
+    {
+        switch (m_txFrame[i])
+        {
+            case SLIP_DELIMITER:
+                m_txSlip[slipLen++] = SLIP_ESC;
+                m_txSlip[slipLen++] = SLIP_ESC_DELIM;
+                break;
+            case SLIP_ESC:
+                m_txSlip[slipLen++] = SLIP_ESC;
+                m_txSlip[slipLen++] = SLIP_ESC_ESC;
+                break;
+            default:
+                m_txSlip[slipLen++] = m_txFrame[i];
+                break;
+        }
+    }
+    m_txSlip[slipLen++] = SLIP_DELIMITER;
+
+    ret = writeBytes(m_txSlip, slipLen);
+
+    IOLockUnlock(m_pWriteLock);
+
+    return ret;
+}
+
+void QCAH5Transport::receiveBytes(const u8 * data, u32 len)
+{
+    u8 c;
+
+    while (len--)
+    {
+        c = *data++;
+
+        if (c == SLIP_DELIMITER)
+        {
+            if (!m_rxDiscard && m_rxFrameLen)
+            {
+                handleFrame(m_rxFrame, m_rxFrameLen);
+            }
+            m_rxEscape = false;
+            m_rxDiscard = false;
+            m_rxFrameLen = 0;
+            continue;
+        }
+
+        if (m_rxDiscard)
+        {
+            continue;
+        }
+
+        if (m_rxEscape)
+        {
+            m_rxEscape = false;
+
+            if (c == SLIP_ESC_DELIM)
+            {
+                c = SLIP_DELIMITER;
+            }
+            else if (c == SLIP_ESC_ESC)
+            {
+                c = SLIP_ESC;
+            }
+            else
+            {
+                /* Corrupted escape, drop the frame */
+                m_rxDiscard = true;
+                continue;
+            }
+        }
+        else if (c == SLIP_ESC)
+        {
+            m_rxEscape = true;
+            continue;
+        }
+
+        if (m_rxFrameLen == sizeof(m_rxFrame))
+        {
+            m_rxDiscard = true;
+            continue;
+        }
+
+        m_rxFrame[m_rxFrameLen++] = c;
+    }
+}
+
+void QCAH5Transport::handleFrame(const u8 * frame, u32 len)
+{
+    const u8 * hdr = frame;
+    u16 plen;
+    u8 ack;
+    bool deliver = false;
+    bool sendAck = false;
+
+    if (len < H5_HDR_SIZE || (u8)(hdr[0] + hdr[1] + hdr[2] + hdr[3]) != 0xff)
+    {
+        DebugLog("(handleFrame) Dropping frame with bad header.\n");
+        return;
+    }
+
+    plen = H5_HDR_LEN(hdr);
+
+    if (len != H5_HDR_SIZE + plen + (H5_HDR_CRC(hdr) ? H5_CRC_SIZE : 0))
+    {
+        DebugLog("(handleFrame) Dropping frame with bad length (%u/%d).\n", (unsigned int) len, plen);
+        return;
+    }
+
+    if (H5_HDR_CRC(hdr) && h5Crc(frame, H5_HDR_SIZE + plen) != get_unaligned_be16(frame + H5_HDR_SIZE + plen))
+    {
+        DebugLog("(handleFrame) Dropping frame with bad CRC.\n");
+        return;
+    }
+
+    if (H5_HDR_PKT_TYPE(hdr) == H5_LINK_CTL_PKT)
+    {
+        handleLinkControl(frame + H5_HDR_SIZE, plen);
+        return;
+    }
+
+    IOLockLock(m_pLock);
+
+    if (m_state != H5_ACTIVE)
+    {
+        IOLockUnlock(m_pLock);
+        return;
+    }
+
+    /* Everything before ack made it through */
+    ack = H5_HDR_ACK(hdr);
+    if (((ack - m_txAck) & (H5_SEQ_COUNT - 1)) <= getUnacked() && ack != m_txAck)
+    {
+        m_txAck = ack;
+        m_retransmits = 0;
+        IOLockWakeup(m_pLock, &m_txAck, false);
+
+        if (!getUnacked())
+        {
+            thread_call_cancel(m_retransmitCall);
+        }
+    }
+
+    if (H5_HDR_RELIABLE(hdr))
+    {
+        /* Out of order means something before it got lost, the controller
+         * resends from there once it sees our ack did not move.
+         */
+        if (H5_HDR_SEQ(hdr) == m_rxSeq)
+        {
+            m_rxSeq = (m_rxSeq + 1) & (H5_SEQ_COUNT - 1);
+            deliver = true;
+        }
+        sendAck = true;
+    }
+
+    IOLockUnlock(m_pLock);
+
+    if (deliver && H5_HDR_PKT_TYPE(hdr) == H4_EVT_PKT)
+    {
+        deliverEvent(frame + H5_HDR_SIZE, plen);
+    }
+
+    if (sendAck)
+    {
+        writeFrame(H5_ACK_PKT, false, 0, NULL, 0);
+    }
+}
@@ -0,0 +1,129 @@
+//
+//  QCAH5Transport.hpp
+//  QCABluetoothFirmware
+//
+//  Copyright © 2021 cjiang. All rights reserved.
+//
+
+#ifndef QCAH5Transport_hpp
+#define QCAH5Transport_hpp
+
+#include "QCAUartTransport.hpp"
+#include <kern/thread_call.h>
+
+#define SLIP_DELIMITER                  0xC0
+#define SLIP_ESC                        0xDB
+#define SLIP_ESC_DELIM                  0xDC
+#define SLIP_ESC_ESC                    0xDD
+
+#define H5_ACK_PKT                      0x00
+#define H5_VENDOR_PKT                   0x0E
+#define H5_LINK_CTL_PKT                 0x0F
+
+#define H5_HDR_SIZE                     4
+#define H5_CRC_SIZE                     2
+#define H5_MAX_PAYLOAD                  (HCI_COMMAND_HDR_SIZE + HCI_MAX_COMMAND_PLEN)
+#define H5_MAX_FRAME                    (H5_HDR_SIZE + H5_MAX_PAYLOAD + H5_CRC_SIZE)
+
+#define H5_SEQ_COUNT                    8
+#define H5_MAX_WINDOW                   7
+#define H5_DEFAULT_WINDOW               4
+
+#define H5_CFG_WINDOW_MASK              0x07
+#define H5_CFG_CRC                      0x10
+
+#define H5_SYNC_INTERVAL                100     /* ms between link establishment messages */
+#define H5_LINK_TIMEOUT                 2000    /* ms */
+#define H5_RETRANSMIT_TIME              250     /* ms */
+#define H5_MAX_RETRANSMITS              10
+
+#define H5_HDR_SEQ(hdr)                 ((hdr)[0] & 0x07)
+#define H5_HDR_ACK(hdr)                 (((hdr)[0] >> 3) & 0x07)
+#define H5_HDR_CRC(hdr)                 (((hdr)[0] >> 6) & 0x01)
+#define H5_HDR_RELIABLE(hdr)            (((hdr)[0] >> 7) & 0x01)
+#define H5_HDR_PKT_TYPE(hdr)            ((hdr)[1] & 0x0f)
+#define H5_HDR_LEN(hdr)                 ((((hdr)[1] >> 4) & 0x0f) + ((hdr)[2] << 4))
+
+enum H5LinkState
+{
+    H5_UNINITIALIZED,
+    H5_INITIALIZED,
+    H5_ACTIVE
+};
+
+/* Sent but not yet acknowledged, kept for retransmission */
+struct H5TxPacket
+{
+    u8          type;
+    u16         len;
+    u8          data[H5_MAX_PAYLOAD];
+};
+
+/* Three-wire UART (H5): SLIP framed packets with a header checksum, an
+ * optional CRC, and reliable delivery of commands and events.
+ *
+ * Up to the negotiated window of commands may be unacknowledged at once.
+ * Anything unacknowledged after H5_RETRANSMIT_TIME is sent again, from
+ * the oldest on (go-back-N), so a lost or corrupted byte only costs a
+ * retransmission instead of a hung download.
+ */
+class QCAH5Transport : public QCAUartTransport
+{
+public:
+    QCAH5Transport(IOSerialStreamSync * stream, OSObject * owner, HciEventAction action, u8 window = H5_DEFAULT_WINDOW);
+    virtual ~QCAH5Transport();
+
+    virtual const char  *   getName() const override    { return "H5"; }
+
+    virtual bool            open(u32 speed) override;
+    virtual void            close() override;
+
+    virtual IOReturn        sendCommand(const HciCommandHdr * cmd, UInt32 timeout) override;
+
+protected:
+    virtual void            receiveBytes(const u8 * data, u32 len) override;
+
+private:
+    static void             retransmitTimer(thread_call_param_t param0, thread_call_param_t param1);
+    void                    armRetransmit();
+
+    bool                    establishLink();
+    bool                    sendLinkMessage(H5LinkState until, const u8 * msg, u16 len);
+    void                    handleLinkControl(const u8 * data, u16 len);
+    void                    handleFrame(const u8 * frame, u32 len);
+    IOReturn                writeFrame(u8 type, bool reliable, u8 seq, const u8 * data, u16 len);
+
+    u8                      getUnacked() const          { return (m_txSeq - m_txAck) & (H5_SEQ_COUNT - 1); }
+    u8                      getConfig() const           { return (m_window & H5_CFG_WINDOW_MASK) | H5_CFG_CRC; }
+
+    IOLock              *   m_pWriteLock;
+    thread_call_t           m_retransmitCall;
+
+    H5LinkState             m_state;
+    u8                      m_window;                   /* asked for */
+    u8                      m_txWindow;                 /* agreed on */
+    bool                    m_useCrc;
+
+    /* Guarded by m_pLock */
+    u8                      m_txSeq;                    /* next sequence number to send */
+    u8                      m_txAck;                    /* oldest unacknowledged */
+    u8                      m_rxSeq;                    /* next expected from the controller */
+    u32                     m_retransmits;
+    H5TxPacket              m_txQueue[H5_SEQ_COUNT];
+    bool                    m_rtxBusy;                  /* m_rtxQueue is being resent */
+
+    /* Only touched by the retransmission owning m_rtxBusy */
+    H5TxPacket              m_rtxQueue[H5_SEQ_COUNT];
+
+    /* Guarded by m_pWriteLock */
+    u8                      m_txFrame[H5_MAX_FRAME];
+    u8                      m_txSlip[2 * H5_MAX_FRAME + 2];
+
+    /* Only touched by the read thread */
+    bool                    m_rxEscape;
+    bool                    m_rxDiscard;
+    u32                     m_rxFrameLen;
+    u8                      m_rxFrame[H5_MAX_FRAME];
+};
+
+#endif /* QCAH5Transport_hpp */
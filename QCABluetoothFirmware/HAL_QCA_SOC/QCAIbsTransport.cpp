@@ -0,0 +1,372 @@
+//
+//  QCAIbsTransport.cpp
+//  QCABluetoothFirmware
+//
+//  Copyright © 2021 cjiang. All rights reserved.
+//
+
+#include "QCAIbsTransport.hpp"
+
+QCAIbsTransport::QCAIbsTransport(IOSerialStreamSync * stream, OSObject * owner, HciEventAction action, UInt32 idleTimeout) : QCAUartTransport(stream, owner, action)
+{
+    m_pWriteLock = IOLockAlloc();
+    m_idleCall = thread_call_allocate(idleTimer, this);
+    m_wakeCall = thread_call_allocate(wakeTimer, this);
+    m_flushCall = thread_call_allocate(flushTimer, this);
+    m_ackCall = thread_call_allocate(ackTimer, this);
+    m_idleTimeout = idleTimeout ? idleTimeout : IBS_TX_IDLE_TIMEOUT;
+
+    m_enabled = false;
+    m_txState = IBS_TX_AWAKE;
+    m_wakeRetries = 0;
+
+    m_txHead = m_txTail = 0;
+}
+
+QCAIbsTransport::~QCAIbsTransport()
+{
+    close();
+
+    if (m_idleCall)
+    {
+        thread_call_free(m_idleCall);
+        m_idleCall = NULL;
+    }
+
+    if (m_wakeCall)
+    {
+        thread_call_free(m_wakeCall);
+        m_wakeCall = NULL;
+    }
+
+    if (m_flushCall)
+    {
+        thread_call_free(m_flushCall);
+        m_flushCall = NULL;
+    }
+
+    if (m_ackCall)
+    {
+        thread_call_free(m_ackCall);
+        m_ackCall = NULL;
+    }
+
+    if (m_pWriteLock)
+    {
+        IOLockFree(m_pWriteLock);
+        m_pWriteLock = NULL;
+    }
+}
+
+void QCAIbsTransport::close()
+{
+    setInBandSleep(false);
+
+    QCAUartTransport::close();
+}
+
+IOReturn QCAIbsTransport::setInBandSleep(bool enable)
+{
+    if (!m_idleCall || !m_wakeCall || !m_flushCall || !m_ackCall || !m_pWriteLock || !m_pLock)
+    {
+        return kIOReturnNoMemory;
+    }
+
+    IOLockLock(m_pLock);
+
+    /* Nothing would wake a sleeping controller once this is off */
+    bool asleep = m_enabled && !enable && m_txState != IBS_TX_AWAKE;
+
+    /* The controller is awake right after it was set up */
+    m_enabled = enable;
+    m_txState = IBS_TX_AWAKE;
+    m_wakeRetries = 0;
+
+    /* Whatever still waits for a wake up is dropped */
+    if (!enable)
+    {
+        m_txHead = m_txTail;
+        IOLockWakeup(m_pLock, &m_txHead, false);
+    }
+
+    IOLockUnlock(m_pLock);
+
+    if (enable)
+    {
+        armTimer(m_idleCall, m_idleTimeout);
+    }
+    else
+    {
+        thread_call_cancel_wait(m_idleCall);
+        thread_call_cancel_wait(m_wakeCall);
+        thread_call_cancel_wait(m_flushCall);
+        thread_call_cancel_wait(m_ackCall);
+
+        if (asleep)
+        {
+            IOLockLock(m_pWriteLock);
+            writeIbs(HCI_IBS_WAKE_IND);
+            IOLockUnlock(m_pWriteLock);
+        }
+    }
+
+    DebugLog("(setInBandSleep) In-band sleep %s.\n", enable ? "enabled" : "disabled");
+
+    return kIOReturnSuccess;
+}
+
+IOReturn QCAIbsTransport::sendCommand(const HciCommandHdr * cmd, UInt32 timeout)
+{
+    UInt64 deadline;
+    IOReturn ret = kIOReturnSuccess;
+    bool wake = false;
+    bool enabled;
+
+    if (!m_pWriteLock)
+    {
+        return kIOReturnNoMemory;
+    }
+
+    IOLockLock(m_pWriteLock);
+    IOLockLock(m_pLock);
+
+    /* Anything still queued goes out first */
+    if (!m_enabled || (m_txState == IBS_TX_AWAKE && m_txHead == m_txTail))
+    {
+        enabled = m_enabled;
+        IOLockUnlock(m_pLock);
+        ret = writeCommand(cmd);
+        IOLockUnlock(m_pWriteLock);
+
+        if (enabled)
+        {
+            armTimer(m_idleCall, m_idleTimeout);
+        }
+        return ret;
+    }
+
+    IOLockUnlock(m_pWriteLock);
+
+    clock_interval_to_deadline(timeout, kMillisecondScale, &deadline);
+
+    /* Commands sent while waking all wait on the one WAKE_IND */
+    while (m_enabled && m_txTail - m_txHead == IBS_TX_QUEUE_SIZE)
+    {
+        if (IOLockSleepDeadline(m_pLock, &m_txHead, deadline, THREAD_UNINT) == THREAD_TIMED_OUT)
+        {
+            IOLockUnlock(m_pLock);
+            ErrorLog("(sendCommand) Controller did not wake up within %u ms!!!\n", (unsigned int) timeout);
+            return kIOReturnTimeout;
+        }
+    }
+
+    if (!m_enabled)
+    {
+        IOLockUnlock(m_pLock);
+        return kIOReturnNotOpen;
+    }
+
+    memcpy(&m_txQueue[m_txTail % IBS_TX_QUEUE_SIZE], cmd, HCI_COMMAND_HDR_SIZE + cmd->plen);
+    ++m_txTail;
+
+    if (m_txState == IBS_TX_ASLEEP)
+    {
+        m_txState = IBS_TX_WAKING;
+        m_wakeRetries = 0;
+        wake = true;
+    }
+
+    IOLockUnlock(m_pLock);
+
+    if (wake)
+    {
+        IOLockLock(m_pWriteLock);
+        ret = writeIbs(HCI_IBS_WAKE_IND);
+        IOLockUnlock(m_pWriteLock);
+
+        armTimer(m_wakeCall, IBS_WAKE_RETRANS_TIMEOUT);
+    }
+    else
+    {
+        /* Awake already, but queued behind commands not yet flushed */
+        thread_call_enter(m_flushCall);
+    }
+
+    return ret;
+}
+
+bool QCAIbsTransport::handleControlByte(u8 c)
+{
+    switch (c)
+    {
+        case HCI_IBS_WAKE_IND:
+        {
+            /* A write may block, which the read thread must not */
+            thread_call_enter(m_ackCall);
+            return true;
+        }
+        case HCI_IBS_SLEEP_IND:
+        {
+            /* Nothing to do, the controller wakes itself to send */
+            return true;
+        }
+        case HCI_IBS_WAKE_ACK:
+        {
+            IOLockLock(m_pLock);
+
+            /* Late acks to repeated WAKE_IND are expected, ignore them */
+            if (m_txState != IBS_TX_WAKING)
+            {
+                IOLockUnlock(m_pLock);
+                return true;
+            }
+
+            m_txState = IBS_TX_AWAKE;
+
+            IOLockUnlock(m_pLock);
+
+            thread_call_cancel(m_wakeCall);
+            thread_call_enter(m_flushCall);
+            armTimer(m_idleCall, m_idleTimeout);
+            return true;
+        }
+        default:
+        {
+            return false;
+        }
+    }
+}
+
+void QCAIbsTransport::idleTimer(thread_call_param_t param0, thread_call_param_t param1)
+{
+    QCAIbsTransport * that = (QCAIbsTransport *) param0;
+    bool sleep = false;
+
+    IOLockLock(that->m_pWriteLock);
+    IOLockLock(that->m_pLock);
+
+    if (that->m_enabled && that->m_txState == IBS_TX_AWAKE && that->m_txHead == that->m_txTail)
+    {
+        that->m_txState = IBS_TX_ASLEEP;
+        sleep = true;
+    }
+
+    IOLockUnlock(that->m_pLock);
+
+    if (sleep)
+    {
+        DebugLog("(idleTimer) Link idle, letting controller sleep.\n");
+
+        that->writeIbs(HCI_IBS_SLEEP_IND);
+    }
+
+    IOLockUnlock(that->m_pWriteLock);
+}
+
+void QCAIbsTransport::wakeTimer(thread_call_param_t param0, thread_call_param_t param1)
+{
+    QCAIbsTransport * that = (QCAIbsTransport *) param0;
+
+    IOLockLock(that->m_pWriteLock);
+    IOLockLock(that->m_pLock);
+
+    if (!that->m_enabled || that->m_txState != IBS_TX_WAKING)
+    {
+        IOLockUnlock(that->m_pLock);
+        IOLockUnlock(that->m_pWriteLock);
+        return;
+    }
+
+    if (++that->m_wakeRetries > IBS_MAX_WAKE_RETRIES)
+    {
+        /* Send anyway rather than hold commands forever, the controller
+         * may have missed SLEEP_IND and be awake already.
+         */
+        ErrorLog("(wakeTimer) No WAKE_ACK from controller, sending anyway!!!\n");
+
+        that->m_txState = IBS_TX_AWAKE;
+        that->flushQueue();
+
+        /* Awake now, so it has to be let sleep again once idle */
+        that->armTimer(that->m_idleCall, that->m_idleTimeout);
+        return;
+    }
+
+    IOLockUnlock(that->m_pLock);
+
+    that->writeIbs(HCI_IBS_WAKE_IND);
+
+    IOLockUnlock(that->m_pWriteLock);
+
+    that->armTimer(that->m_wakeCall, IBS_WAKE_RETRANS_TIMEOUT);
+}
+
+void QCAIbsTransport::flushTimer(thread_call_param_t param0, thread_call_param_t param1)
+{
+    QCAIbsTransport * that = (QCAIbsTransport *) param0;
+
+    IOLockLock(that->m_pWriteLock);
+    IOLockLock(that->m_pLock);
+
+    if (that->m_enabled && that->m_txState == IBS_TX_AWAKE)
+    {
+        that->flushQueue();
+        return;
+    }
+
+    IOLockUnlock(that->m_pLock);
+    IOLockUnlock(that->m_pWriteLock);
+}
+
+void QCAIbsTransport::ackTimer(thread_call_param_t param0, thread_call_param_t param1)
+{
+    QCAIbsTransport * that = (QCAIbsTransport *) param0;
+
+    IOLockLock(that->m_pWriteLock);
+    that->writeIbs(HCI_IBS_WAKE_ACK);
+    IOLockUnlock(that->m_pWriteLock);
+}
+
+void QCAIbsTransport::armTimer(thread_call_t call, UInt32 ms)
+{
+    UInt64 deadline;
+
+    clock_interval_to_deadline(ms, kMillisecondScale, &deadline);
+    thread_call_enter_delayed(call, deadline);
+}
+
+/* Called with m_pWriteLock and m_pLock held, returns with neither. The
+ * queue is copied out so that the writes happen without m_pLock, which
+ * the read thread needs for every control byte.
+ */
+void QCAIbsTransport::flushQueue()
+{
+    u32 count = 0;
+
+    while (m_txHead != m_txTail)
+    {
+        HciCommandHdr * cmd = &m_txQueue[m_txHead % IBS_TX_QUEUE_SIZE];
+        memcpy(&m_txFlush[count++], cmd, HCI_COMMAND_HDR_SIZE + cmd->plen);
+        ++m_txHead;
+    }
+
+    IOLockWakeup(m_pLock, &m_txHead, false);
+    IOLockUnlock(m_pLock);
+
+    for (u32 i = 0; i < count; ++i)
+    {
+        writeCommand(&m_txFlush[i]);
+    }
+
+    IOLockUnlock(m_pWriteLock);
+}
+
+IOReturn QCAIbsTransport::writeCommand(const HciCommandHdr * cmd)
+{
+    return QCAUartTransport::sendCommand(cmd, 0);
+}
+
+IOReturn QCAIbsTransport::writeIbs(u8 ind)
+{
+    return writeBytes(&ind, 1);
+}
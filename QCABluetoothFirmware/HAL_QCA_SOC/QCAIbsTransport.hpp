@@ -0,0 +1,86 @@
+//
+//  QCAIbsTransport.hpp
+//  QCABluetoothFirmware
+//
+//  Copyright © 2021 cjiang. All rights reserved.
+//
+
+#ifndef QCAIbsTransport_hpp
+#define QCAIbsTransport_hpp
+
+#include "QCAUartTransport.hpp"
+#include <kern/thread_call.h>
+
+#define HCI_IBS_SLEEP_IND               0xFE
+#define HCI_IBS_WAKE_IND                0xFD
+#define HCI_IBS_WAKE_ACK                0xFC
+
+#define IBS_TX_IDLE_TIMEOUT             2000    /* ms without TX before telling the controller to sleep */
+#define IBS_WAKE_RETRANS_TIMEOUT        100     /* ms between wake indications */
+#define IBS_MAX_WAKE_RETRIES            10
+#define IBS_TX_QUEUE_SIZE               4
+
+enum IbsTxState
+{
+    IBS_TX_ASLEEP,
+    IBS_TX_WAKING,
+    IBS_TX_AWAKE
+};
+
+/* H4 with Qualcomm in-band sleep.
+ *
+ * Once enabled (after the NVM turned it on in the controller), the host
+ * sends SLEEP_IND when nothing went out for the idle timeout. A command
+ * sent while asleep is queued behind a single WAKE_IND, which is repeated
+ * until the controller acks, and the queue is flushed on WAKE_ACK. The
+ * controller's own WAKE_IND are acked from a thread call, as are flushes,
+ * so that the read thread never waits for a write.
+ */
+class QCAIbsTransport : public QCAUartTransport
+{
+public:
+    QCAIbsTransport(IOSerialStreamSync * stream, OSObject * owner, HciEventAction action, UInt32 idleTimeout = IBS_TX_IDLE_TIMEOUT);
+    virtual ~QCAIbsTransport();
+
+    virtual const char  *   getName() const override    { return "H4 (IBS)"; }
+
+    virtual void            close() override;
+
+    virtual IOReturn        sendCommand(const HciCommandHdr * cmd, UInt32 timeout) override;
+    virtual IOReturn        setInBandSleep(bool enable) override;
+
+protected:
+    virtual bool            handleControlByte(u8 c) override;
+
+private:
+    static void             idleTimer(thread_call_param_t param0, thread_call_param_t param1);
+    static void             wakeTimer(thread_call_param_t param0, thread_call_param_t param1);
+    static void             flushTimer(thread_call_param_t param0, thread_call_param_t param1);
+    static void             ackTimer(thread_call_param_t param0, thread_call_param_t param1);
+    void                    armTimer(thread_call_t call, UInt32 ms);
+
+    IOReturn                writeCommand(const HciCommandHdr * cmd);
+    IOReturn                writeIbs(u8 ind);
+    void                    flushQueue();
+
+    IOLock              *   m_pWriteLock;               /* taken before m_pLock */
+    thread_call_t           m_idleCall;
+    thread_call_t           m_wakeCall;
+    thread_call_t           m_flushCall;
+    thread_call_t           m_ackCall;
+    UInt32                  m_idleTimeout;
+
+    /* Guarded by m_pLock */
+    bool                    m_enabled;
+    IbsTxState              m_txState;
+    u32                     m_wakeRetries;
+
+    HciCommandHdr           m_txQueue[IBS_TX_QUEUE_SIZE];
+    u32                     m_txHead;
+    u32                     m_txTail;
+
+    /* Guarded by m_pWriteLock, which is held for every write */
+    HciCommandHdr           m_txFlush[IBS_TX_QUEUE_SIZE];
+};
+
+#endif /* QCAIbsTransport_hpp */
@@ -11,333 +11,1094 @@
 #define super QCABluetoothFirmware
 OSDefineMetaClassAndStructors(QCASoCFirmware, QCABluetoothFirmware)
 
+static const EdlRoute EdlRoutes[] =
+{
+    { EDL_PATCH_CMD_OPCODE,     EDL_PATCH_VER_REQ_CMD,      EDL_APP_VER_RES_EVT,    EDL_PATCH_VER_REQ_CMD,      1,  0                                       },
+    { EDL_PATCH_CMD_OPCODE,     EDL_PATCH_TLV_REQ_CMD,      EDL_TVL_DNLD_RES_EVT,   EDL_PATCH_TLV_REQ_CMD,      0,  EDL_ROUTE_LEN_PREFIX | EDL_ROUTE_RESULT },
+    { EDL_PATCH_CMD_OPCODE,     EDL_GET_BUILD_INFO_CMD,     EDL_GET_BUILD_INFO_CMD, EDL_GET_BUILD_INFO_CMD,     1,  0                                       },
+    { EDL_NVM_ACCESS_OPCODE,    EDL_NVM_ACCESS_SET_REQ_CMD, EDL_RTYPE_ANY,          EDL_RTYPE_ANY,              0,  0                                       },
+};
+
+/* Keyed by what the controller reports, most specific entries first.
+ * Only WCN3991 and later answer EDL_GET_BUILD_INFO_CMD, WCN3990/3998 let
+ * it run into the timeout.
+ */
+static constexpr QCASoCPlan SoCPlans[] =
+{
+    /* socType          socId                   socIdMask                   romVer  rampatch                    nvm                     dnldMode            CC      log     build   operSpeed                         */
+    { QCA_INVALID,      0x00000013,             QCA_SOC_ID_EXACT_MASK,      0x0300, "rampatch_00130300.bin",    "nvm_00130300.bin",     QCA_SKIP_EVT_NONE,  false,  false,  false,  QCA_UART_OPER_SPEED             },
+    { QCA_INVALID,      0x00000013,             QCA_SOC_ID_EXACT_MASK,      0x0302, "rampatch_00130302.bin",    "nvm_00130302.bin",     QCA_SKIP_EVT_NONE,  false,  false,  false,  QCA_UART_OPER_SPEED             },
+    { QCA_INVALID,      0x00000023,             QCA_SOC_ID_EXACT_MASK,      0x0302, "rampatch_00230302.bin",    "nvm_00230302.bin",     QCA_SKIP_EVT_NONE,  false,  false,  false,  QCA_UART_OPER_SPEED             },
+    { QCA_INVALID,      0x00000044,             QCA_SOC_ID_EXACT_MASK,      0x0302, "rampatch_00440302.bin",    "nvm_00440302.bin",     QCA_SKIP_EVT_NONE,  false,  false,  false,  QCA_UART_OPER_SPEED             },
+    { QCA_INVALID,      QCA_WCN3991_SOC_ID,     QCA_SOC_ID_EXACT_MASK,      0x0302, "crbtfw32.tlv",             "crnv32u.bin",          QCA_SKIP_EVT_NONE,  true,   true,   true,   QCA_WCN399X_UART_OPER_SPEED     },
+    { QCA_INVALID,      QCA_SOC_ID_WCN399X,     QCA_SOC_ID_FAMILY_MASK,     0x0201, "crbtfw21.tlv",             "crnv21.bin",           QCA_SKIP_EVT_NONE,  false,  false,  false,  QCA_WCN399X_UART_OPER_SPEED     },
+    { QCA_INVALID,      QCA_SOC_ID_WCN399X,     QCA_SOC_ID_FAMILY_MASK,     0x0302, "crbtfw32.tlv",             "crnv32.bin",           QCA_SKIP_EVT_NONE,  false,  false,  false,  QCA_WCN399X_UART_OPER_SPEED     },
+    { QCA_QCA6390,      0,                      0,                          0x0200, "htbtfw20.tlv",             "htnv20.bin",           QCA_SKIP_EVT_NONE,  true,   true,   true,   QCA_WCN399X_UART_OPER_SPEED     },
+};
+
 bool QCASoCFirmware::start(IOService * provider)
 {
-    if (!isQcaSoc())
+    if (!isQcaSoc())
+    {
+        return false;
+    }
+    
+    FuncLog("start");
+    
+    m_plan = NULL;
+    m_poweredOff = false;
+    m_nvmInBandSleep = false;
+    m_imageKey = 0;
+    m_edlRtype = EDL_RTYPE_ANY;
+    m_tlvSegments = NULL;
+    m_tlvSegmentCount = 0;
+    
+    IOSerialStreamSync * stream = OSDynamicCast(IOSerialStreamSync, provider);
+    
+    m_pUSBDevice = OSDynamicCast(IOUSBHostDevice, provider);
+    
+    if (!m_pUSBDevice && !stream)
+    {
+        ErrorLog("(start) Provider is neither a USB device nor a serial port!!!\n");
+        releaseAll();
+        return false;
+    }
+
+    powerStart(provider);
+    
+    if (!super::start(provider))
+    {
+        ErrorLog("(start) Super start failed!!!\n");
+        releaseAll();
+        return false;
+    }
+    
+    if (stream)
+    {
+        if (!initUartTransport(stream))
+        {
+            ErrorLog("(start) Failed to open UART transport!!!\n");
+            releaseAll();
+            return false;
+        }
+    }
+    else
+    {
+        if (!restDevice() || m_pUSBDevice->setConfiguration(0))
+        {
+            ErrorLog("(start) Failed to reset the device!!!\n");
+            releaseAll();
+            return false;
+        }
+        
+        DebugLog("(start) Device successfully reset.\n");
+        
+        if (!initUSBConfiguration())
+        {
+            ErrorLog("(start) Failed to initialize USB configuration!!!\n");
+            releaseAll();
+            return false;
+        }
+        
+        if (!initInterface())
+        {
+            ErrorLog("(start) Failed to initialize interface!!!\n");
+            releaseAll();
+            return false;
+        }
+    }
+    
+    if (!initCommandGate())
+    {
+        ErrorLog("(start) Failed to initialize command gate!!!\n");
+        releaseAll();
+        return false;
+    }
+    
+    OSNumber * depth = OSDynamicCast(OSNumber, getProperty("EDLPipelineDepth"));
+    m_edlPipelineDepth = depth && depth->unsigned32BitValue() ? depth->unsigned32BitValue() : QCA_EDL_PIPELINE_DEPTH;
+    
+    /* Acks beyond the event ring would overwrite each other */
+    if (m_edlPipelineDepth > HCI_EVENT_RING_SIZE)
+    {
+        WarningLog("(start) EDLPipelineDepth %u is deeper than the event ring, using %d!\n", (unsigned int) m_edlPipelineDepth, HCI_EVENT_RING_SIZE);
+        m_edlPipelineDepth = HCI_EVENT_RING_SIZE;
+    }
+    
+    //setBluetoothAddress...
+    
+    /* Hundreds of HCI round trips, not for the matching thread */
+    return startBringUp();
+}
+
+bool QCASoCFirmware::bringUpDevice()
+{
+    return powerOn() && bringUp();
+}
+
+void QCASoCFirmware::stop(IOService * provider)
+{
+    FuncLog("stop");
+    
+    waitBringUp(true);
+    
+    /* Left running for the next probe, which then finds it provisioned */
+    if (m_plan && !m_poweredOff)
+    {
+        powerOff(false);
+    }
+    
+    super::stop(provider);
+}
+
+/* Wake may mean a full download, so it runs as a bring-up of its own and
+ * acknowledges the change once done instead of holding the PM thread.
+ */
+IOReturn QCASoCFirmware::setPowerState(unsigned long powerStateOrdinal, IOService * whatDevice)
+{
+    IOReturn ret;
+    
+    /* Let a running bring-up finish before powering the SoC around */
+    waitBringUp(false);
+    
+    ret = super::setPowerState(powerStateOrdinal, whatDevice);
+    
+    /* The initial call comes before bring-up, nothing to do then */
+    if (!powerStateOrdinal && m_plan && !m_poweredOff)
+    {
+        powerOff(true);
+    }
+    else if (powerStateOrdinal && m_poweredOff)
+    {
+        if (startBringUp(true))
+        {
+            return QCA_WAKE_SETTLE_TIME;
+        }
+        
+        ErrorLog("(setPowerState) Failed to bring the SoC back up!!!\n");
+        setBringUpState(QCA_BRINGUP_FAILED);
+    }
+    
+    return ret;
+}
+
+/* Everything from the version read on, also run again on wake */
+bool QCASoCFirmware::bringUp()
+{
+    if (!readSoCVersion() || !(m_plan = findSoCPlan(m_fwVersion)))
+    {
+        return false;
+    }
+    
+    getNVMConfig();
+
+    /* Version is read at the initial speed, everything after at full speed */
+    if (!setOperatingSpeed())
+    {
+        return false;
+    }
+
+    /* A warm reset leaves the firmware running, loading it again only costs time */
+    bool downloaded = false;
+    
+    if (!isProvisioned())
+    {
+        clearFirmwareBuild();
+        
+        if (!loadRamPatch())
+        {
+            return false;
+        }
+
+        if (!loadNVM())
+        {
+            return false;
+        }
+        
+        downloaded = true;
+    }
+
+    if (m_plan->disableLogging && !disableSoCLogging())
+    {
+        return false;
+    }
+
+    /* Perform HCI reset */
+    if (!resetDevice())
+    {
+        return false;
+    }
+    
+    if (downloaded)
+    {
+        cacheFirmwareBuild();
+    }
+
+    /* The NVM has turned in-band sleep on in the controller, follow suit */
+    if (m_pTransport && m_nvmInBandSleep && m_pTransport->setInBandSleep(true))
+    {
+        DebugLog("(bringUp) %s transport has no in-band sleep.\n", m_pTransport->getName());
+    }
+
+    return true;
+}
+
+/* The serial port comes up at the speed the controller was left at, the
+ * initial one once power was cut. WCN399x also needs a pulse on the TX
+ * line before it boots.
+ */
+bool QCASoCFirmware::powerOn()
+{
+    u32 speed = getLastSpeed();
+    
+    if (m_pTransport && m_poweredOff && !m_pTransport->open(speed ? speed : QCA_UART_INIT_SPEED))
+    {
+        ErrorLog("(powerOn) Failed to reopen %s transport!!!\n", m_pTransport->getName());
+        return false;
+    }
+    
+    m_poweredOff = false;
+    
+    if (hasPowerPulse())
+    {
+        if (m_pTransport->sendPowerPulse(QCA_WCN3990_POWERON_PULSE, QCA_UART_INIT_SPEED))
+        {
+            ErrorLog("(powerOn) Failed to send power on pulse!!!\n");
+            return false;
+        }
+        IOSleep(QCA_WCN3990_BOOT_TIME);
+    }
+    
+    return true;
+}
+
+/* Bounded by the pre-shutdown timeout plus a few ms: with cutPower tell
+ * the firmware and cut power where we can, then let go of the port.
+ */
+void QCASoCFirmware::powerOff(bool cutPower)
+{
+    FuncLog("powerOff");
+    
+    /* ROME and AR3002 have no such command */
+    if (cutPower && m_socType >= QCA_WCN3990 && sendPreShutdownCommand(QCA_PRE_SHUTDOWN_TIMEOUT))
+    {
+        IOSleep(QCA_PRE_SHUTDOWN_DELAY);
+    }
+    
+    if (m_pTransport)
+    {
+        m_pTransport->setInBandSleep(false);
+        
+        /* Without power the firmware is gone and the UART back at its
+         * initial speed, do not even ask on wake.
+         */
+        if (cutPower && hasPowerPulse() && !m_pTransport->sendPowerPulse(QCA_WCN3990_POWEROFF_PULSE, QCA_WCN3990_POWEROFF_SPEED))
+        {
+            clearFirmwareBuild();
+            
+            if (getProvider())
+            {
+                getProvider()->removeProperty(QCA_UART_SPEED_PROPERTY);
+            }
+        }
+        
+        m_pTransport->close();
+    }
+    
+    m_poweredOff = true;
+}
+
+const EdlRoute * QCASoCFirmware::getEdlRoute(u16 opcode, u8 subCmd)
+{
+    for (int i = 0; i < ARRAY_SIZE(EdlRoutes); ++i)
+    {
+        if (EdlRoutes[i].opcode == opcode && EdlRoutes[i].subCmd == subCmd)
+        {
+            return &EdlRoutes[i];
+        }
+    }
+    return NULL;
+}
+
+inline bool QCASoCFirmware::edlRepliesInCC()
+{
+    /* Unlike other SoC's sending command responses as payload to
+     * VSE event. WCN3991 sends them as a payload to command complete event.
+     * Until the version is known, go by the matched device type.
+     */
+    return m_plan ? m_plan->replyInCC : m_socType >= QCA_WCN3991;
+}
+
+/* Writes the EDL header straight into the HCI command buffer and returns
+ * where the payload goes, so it only has to be copied once.
+ */
+u8 * QCASoCFirmware::getEdlPayloadBuffer(u16 opcode, u8 subCmd, u8 len)
+{
+    const EdlRoute * route = getEdlRoute(opcode, subCmd);
+    u8 * cmd = getHCICommandParams();
+    u8 hdrLen = 1;
+    
+    if (!route)
+    {
+        ErrorLog("(getEdlPayloadBuffer) No route for EDL request 0x%04x/0x%02x!!!\n", opcode, subCmd);
+        return NULL;
+    }
+    
+    cmd[0] = subCmd;
+    
+    if (route->flags & EDL_ROUTE_LEN_PREFIX)
+    {
+        cmd[hdrLen++] = len;
+    }
+    
+    if (len > HCI_MAX_COMMAND_PLEN - hdrLen)
+    {
+        ErrorLog("(getEdlPayloadBuffer) EDL payload is too long (len: %d)!!!\n", len);
+        return NULL;
+    }
+    
+    return cmd + hdrLen;
+}
+
+IOReturn QCASoCFirmware::submitEdlPayload(u16 opcode, const u8 * payload, u8 len, UInt32 timeout)
+{
+    const u8 * cmd = getHCICommandParams();
+    
+    return submitHCIRequest(opcode, (payload - cmd) + len, cmd, timeout);
+}
+
+IOReturn QCASoCFirmware::submitEdlRequest(u16 opcode, u8 subCmd, const void * data, u8 len, UInt32 timeout)
+{
+    u8 * payload = getEdlPayloadBuffer(opcode, subCmd, len);
+    
+    if (!payload)
+    {
+        return kIOReturnBadArgument;
+    }
+    
+    memcpy(payload, data, len);
+    
+    return submitEdlPayload(opcode, payload, len, timeout);
+}
+
+/* Skips EDL replies whose rtype belongs to another request, e.g. a late
+ * one to a request that already timed out.
+ */
+bool QCASoCFirmware::isHCIReply(u16 opCode, const u8 * params, u8 len)
+{
+    if (opCode == EDL_SET_BAUDRATE_CMD_OPCODE)
+    {
+        return len && params[0] == EDL_SET_BAUDRATE_RSP_EVT;
+    }
+    
+    if (m_edlRtype == EDL_RTYPE_ANY)
+    {
+        return true;
+    }
+    
+    EdlEventView edl(params, len);
+    
+    return edl.isValid() && edl.rtype() == m_edlRtype;
+}
+
+IOReturn QCASoCFirmware::waitEdlReply(u16 opcode, u8 subCmd, const u8 ** payload, u8 * payloadLen, UInt32 timeout)
+{
+    UInt64 deadline;
+    
+    clock_interval_to_deadline(timeout, kMillisecondScale, &deadline);
+    
+    return waitEdlReplyUntil(opcode, subCmd, deadline, payload, payloadLen);
+}
+
+IOReturn QCASoCFirmware::waitEdlReplyUntil(u16 opcode, u8 subCmd, UInt64 deadline, const u8 ** payload, u8 * payloadLen)
+{
+    const EdlRoute * route = getEdlRoute(opcode, subCmd);
+    bool cc = edlRepliesInCC();
+    u8 rtype, offset;
+    IOReturn ret;
+    
+    if (!route)
+    {
+        return kIOReturnUnsupported;
+    }
+    
+    rtype  = cc ? route->ccRtype : route->vseRtype;
+    offset = cc ? route->ccOffset : 0;
+    
+    m_edlRtype = rtype;
+    ret = waitHCIReplyUntil(opcode, cc ? 0 : HCI_EV_VENDOR, deadline);
+    m_edlRtype = EDL_RTYPE_ANY;
+    
+    if (ret)
+    {
+        return ret;
+    }
+    
+    EdlEventView edl(m_hciEventData, m_hciEventLen);
+    
+    if (!edl.isValid() || edl.dataLen() < offset)
+    {
+        ErrorLog("(waitEdlReply) EDL reply to 0x%04x/0x%02x has no header!!!\n", opcode, subCmd);
+        return kIOReturnUnderrun;
+    }
+    
+    if (edl.cresp() != EDL_CMD_REQ_RES_EVT || (rtype != EDL_RTYPE_ANY && edl.rtype() != rtype))
+    {
+        ErrorLog("(waitEdlReply) EDL reply with error (cresp: 0x%x, rtype: 0x%x)!!!\n", edl.cresp(), edl.rtype());
+        return kIOReturnIOError;
+    }
+    
+    if (!cc && (route->flags & EDL_ROUTE_RESULT))
+    {
+        const u8 * result = edl.payload<u8>();
+        
+        if (!result || * result)
+        {
+            ErrorLog("(waitEdlReply) EDL request failed (cresp: 0x%x, rtype: 0x%x, result: 0x%x)!!!\n", edl.cresp(), edl.rtype(), result ? * result : 0xff);
+            return kIOReturnIOError;
+        }
+    }
+    
+    if (payload)
+    {
+        * payload = edl.data() + offset;
+    }
+    if (payloadLen)
+    {
+        * payloadLen = edl.dataLen() - offset;
+    }
+    
+    return kIOReturnSuccess;
+}
+
+IOReturn QCASoCFirmware::sendEdlRequest(u16 opcode, u8 subCmd, const void * data, u8 len, const u8 ** payload, u8 * payloadLen, UInt32 timeout)
+{
+    IOReturn ret;
+    UInt64 deadline;
+    
+    if (m_pCommandGate)
+    {
+        m_pCommandGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &QCASoCFirmware::flushEventsGated));
+    }
+    
+    clock_interval_to_deadline(timeout, kMillisecondScale, &deadline);
+    
+    ret = submitEdlRequest(opcode, subCmd, data, len, timeout);
+    
+    if (ret)
+    {
+        return ret;
+    }
+    
+    return waitEdlReplyUntil(opcode, subCmd, deadline, payload, payloadLen);
+}
+
+bool QCASoCFirmware::getSoCVersion()
+{
+    const QCASoCVersion * version;
+    const u8 * payload;
+    u8 payloadLen;
+
+    if (sendEdlRequest(EDL_PATCH_CMD_OPCODE, EDL_PATCH_VER_REQ_CMD, NULL, 0, &payload, &payloadLen))
+    {
+        ErrorLog("Failed to read version!!!\n");
+        return false;
+    }
+
+    if (payloadLen < sizeof( QCASoCVersion ))
+    {
+        ErrorLog("Version size mismatch (len: %d)!!!\n", payloadLen);
+        return false;
+    }
+    
+    version = (const QCASoCVersion *) payload;
+
+    InfoLog("Product ID:        0x%08x", le32_to_cpu(version->product_id));
+    InfoLog("SOC Version:       0x%08x", le32_to_cpu(version->soc_id));
+    InfoLog("ROM Version:       0x%08x", le16_to_cpu(version->rom_ver));
+    InfoLog("Patch Version:     0x%08x", le32_to_cpu(version->patch_ver));
+
+    if (version->soc_id == 0 || version->rom_ver == 0)
+    {
+        ErrorLog("Failed to get SoC version!!!\n");
+        return false;
+    }
+    
+    /* The event slot is recycled by the next command, keep the version */
+    if (!m_fwVersion)
+    {
+        m_fwVersion = new QCASoCVersion;
+    }
+    * m_fwVersion = * version;
+    
+    return true;
+}
+
+/* Speed the UART was last switched to, 0 if it is at the initial one */
+u32 QCASoCFirmware::getLastSpeed()
+{
+    IOService * provider = getProvider();
+    OSNumber * speed = provider && m_pTransport ? OSDynamicCast(OSNumber, provider->getProperty(QCA_UART_SPEED_PROPERTY)) : NULL;
+    
+    return speed ? speed->unsigned32BitValue() : 0;
+}
+
+/* A controller that kept its power, across a warm re-probe or a sleep
+ * without a power cut, still runs at the speed it was last switched to.
+ */
+bool QCASoCFirmware::readSoCVersion()
+{
+    u32 speed = getLastSpeed();
+    
+    if (!speed)
+    {
+        return getSoCVersion();
+    }
+    
+    DebugLog("(readSoCVersion) Trying the last speed, %u baud.\n", (unsigned int) speed);
+    
+    if ((speed == m_pTransport->getSpeed() || !m_pTransport->setSpeed(speed)) && getSoCVersion())
+    {
+        return true;
+    }
+    
+    /* Lost power after all */
+    getProvider()->removeProperty(QCA_UART_SPEED_PROPERTY);
+    
+    if (m_pTransport->setSpeed(QCA_UART_INIT_SPEED))
+    {
+        return false;
+    }
+    
+    return getSoCVersion();
+}
+
+bool QCASoCFirmware::sendPreShutdownCommand(UInt32 timeout)
+{
+    FuncLog("sendPreShutdownCommand");
+    
+    if (sendHCIRequest(QCA_PRE_SHUTDOWN_CMD, 0, NULL, HCI_EV_CMD_COMPLETE, timeout))
+    {
+        ErrorLog("Failed to send pre-shutdown command!!!\n");
+        return false;
+    }
+
+    return true;
+}
+
+bool QCASoCFirmware::getBuildInfo(char * build, u32 size)
+{
+    const u8 * payload;
+    u8 payloadLen, len;
+
+    if (sendEdlRequest(EDL_PATCH_CMD_OPCODE, EDL_GET_BUILD_INFO_CMD, NULL, 0, &payload, &payloadLen))
+    {
+        ErrorLog("Failed to read firmware build info!!!\n");
+        return false;
+    }
+
+    /* Length byte, then the label without a terminator */
+    if (!payloadLen || payload[0] > payloadLen - 1)
+    {
+        ErrorLog("Build info size mismatch (len: %d)!!!\n", payloadLen);
+        return false;
+    }
+    
+    len = payload[0] < size - 1 ? payload[0] : size - 1;
+    memcpy(build, payload + 1, len);
+    build[len] = 0;
+
+    InfoLog("Firmware Build:    %s", build);
+    
+    return true;
+}
+
+/* FNV-1a, carried on from sum */
+static u32 getImageSum(u32 sum, const u8 * data, u32 len)
+{
+    while (len--)
+    {
+        sum = (sum ^ *data++) * 16777619;
+    }
+    return sum;
+}
+
+/* Identifies what a download would leave running: the rampatch as it is
+ * and the NVM as it would be sent, overlay applied. A kext update or a
+ * changed BaudRate, InBandSleep or NVMTagOverrides changes the key.
+ */
+bool QCASoCFirmware::getImageKey(u32 * key)
+{
+    const FwDesc * rampatch = findFwDesc(m_plan->rampatch);
+    OSData * nvm = getFwDescByName(m_plan->nvm);
+    const u8 * data;
+    u8 chunk[64];
+    u32 sum = 2166136261, len;
+    bool ok;
+    
+    if (!rampatch || !nvm)
+    {
+        OSSafeReleaseNULL(nvm);
+        return false;
+    }
+    
+    sum = getImageSum(sum, rampatch->var, (u32) rampatch->size);
+    
+    /* Lays out the overlay just as loadNVM will */
+    m_tlvType = TLV_TYPE_NVM;
+    strlcpy(m_fwFilename, m_plan->nvm, sizeof(m_fwFilename));
+    
+    if ((ok = checkTLVData(nvm)))
+    {
+        data = (const u8 *) nvm->getBytesNoCopy();
+        
+        for (u32 offset = 0; offset < nvm->getLength(); offset += len)
+        {
+            len = min(nvm->getLength() - offset, (u32) sizeof(chunk));
+            memcpy(chunk, data + offset, len);
+            m_tlvOverlay.apply(offset, chunk, len);
+            sum = getImageSum(sum, chunk, len);
+        }
+    }
+    
+    OSSafeReleaseNULL(nvm);
+    
+    * key = ok ? sum : 0;
+    return ok;
+}
+
+/* Same image, same version tuple (patch version included) and same build
+ * label as the last download on this provider.
+ */
+bool QCASoCFirmware::isProvisioned()
+{
+    IOService * provider = getProvider();
+    char build[QCA_FW_BUILD_VER_LEN];
+    
+    if (!m_plan->buildInfo || !provider || !getImageKey(&m_imageKey))
     {
         return false;
     }
     
-    FuncLog("start");
-    
-    m_pUSBDevice = OSDynamicCast(IOUSBHostDevice, provider);
+    OSData * cachedVersion = OSDynamicCast(OSData, provider->getProperty(QCA_FW_VERSION_PROPERTY));
+    OSString * cachedBuild = OSDynamicCast(OSString, provider->getProperty(QCA_FW_BUILD_PROPERTY));
+    OSNumber * cachedImage = OSDynamicCast(OSNumber, provider->getProperty(QCA_FW_IMAGE_PROPERTY));
     
-    if (!m_pUSBDevice)
+    if (!cachedVersion || !cachedBuild || !cachedImage || !cachedVersion->isEqualTo(m_fwVersion, sizeof(QCASoCVersion)))
     {
-        ErrorLog("(start) Provider is not a USB device!!!\n");
-        releaseAll();
         return false;
     }
-
-    powerStart(provider);
     
-    if (!super::start(provider))
+    if (cachedImage->unsigned32BitValue() != m_imageKey)
     {
-        ErrorLog("(start) Super start failed!!!\n");
-        releaseAll();
+        InfoLog("Running firmware differs from the image to load, downloading again.\n");
         return false;
     }
     
-    if (!restDevice() || m_pUSBDevice->setConfiguration(0))
+    if (!getBuildInfo(build, sizeof(build)) || !cachedBuild->isEqualTo(build))
     {
-        ErrorLog("(start) Failed to reset the device!!!\n");
-        releaseAll();
         return false;
     }
     
-    DebugLog("(start) Device successfully reset.\n");
+    InfoLog("Firmware %s is already running, skipping download.\n", build);
+    
+    return true;
+}
+
+void QCASoCFirmware::cacheFirmwareBuild()
+{
+    IOService * provider = getProvider();
+    char build[QCA_FW_BUILD_VER_LEN];
     
-    if (!initUSBConfiguration())
+    if (!m_plan->buildInfo || !provider || !m_imageKey)
     {
-        ErrorLog("(start) Failed to initialize USB configuration!!!\n");
-        releaseAll();
-        return false;
+        return;
     }
     
-    if (!initInterface())
+    /* The patch version changes with the download, read it again */
+    if (!getSoCVersion() || !getBuildInfo(build, sizeof(build)))
     {
-        ErrorLog("(start) Failed to initialize interface!!!\n");
-        releaseAll();
-        return false;
+        return;
     }
     
-    getSoCVersion();
+    provider->setProperty(QCA_FW_VERSION_PROPERTY, m_fwVersion, sizeof(QCASoCVersion));
+    provider->setProperty(QCA_FW_BUILD_PROPERTY, build);
+    provider->setProperty(QCA_FW_IMAGE_PROPERTY, m_imageKey, 32);
+}
+
+/* Whatever was cached is stale once a download starts or the SoC loses power */
+void QCASoCFirmware::clearFirmwareBuild()
+{
+    IOService * provider = getProvider();
+    
+    if (provider)
+    {
+        provider->removeProperty(QCA_FW_VERSION_PROPERTY);
+        provider->removeProperty(QCA_FW_BUILD_PROPERTY);
+        provider->removeProperty(QCA_FW_IMAGE_PROPERTY);
+    }
+}
+
+/* Validates every record up front and lays out the download, so the
+ * records can then be streamed back to back without looking at the
+ * blob again.
+ */
+bool QCASoCFirmware::checkTLVData(OSData * fwData)
+{
+    const u8 * data = (const u8 *) fwData->getBytesNoCopy();
+    const TlvRecord * record;
+    TlvDownloadUnit * unit;
+    bool found = false;
 
-    //getBaudRate();
-    //m_bdRate = baudrate;
+    m_dnldMode = m_plan ? m_plan->dnldMode : QCA_SKIP_EVT_NONE;
+    m_tlvOverlay.reset();
+    m_tlvUnitCount = 0;
 
-    if (!loadRamPatch())
+    if (!m_tlvIndex.parse(data, fwData->getLength()))
     {
+        ErrorLog("Invalid TLV data in %s!!!\n", m_fwFilename);
         return false;
     }
 
-    if (!loadNVM())
+    for (u32 i = 0; i < m_tlvIndex.getRecordCount(); ++i)
+    {
+        record = m_tlvIndex.getRecord(i);
+        
+        InfoLog("TLV Type:                      0x%x",      record->type);
+        InfoLog("Length:                        %d bytes",  record->length);
+        
+        unit = &m_tlvUnits[m_tlvUnitCount++];
+        unit->type = record->type;
+        unit->offset = record->offset - TLV_HDR_SIZE;
+        unit->length = record->length + TLV_HDR_SIZE;
+        unit->dnldMode = m_dnldMode;
+
+        switch (record->type)
+        {
+            case TLV_TYPE_PATCH:
+            {
+                if (!checkTLVPatch(data, record, &unit->dnldMode))
+                {
+                    return false;
+                }
+                break;
+            }
+            case TLV_TYPE_NVM:
+            {
+                break;
+            }
+            default:
+            {
+                ErrorLog("Unknown TLV type (%d) in %s!!!\n", record->type, m_fwFilename);
+                return false;
+            }
+        }
+        
+        found |= record->type == m_tlvType;
+    }
+    
+    if (!found)
     {
+        ErrorLog("No TLV record of type %d in %s!!!\n", m_tlvType, m_fwFilename);
         return false;
     }
+    
+    if (m_tlvIndex.findRecord(TLV_TYPE_NVM))
+    {
+        InfoLog("NVM Tags:                      %d",        m_tlvIndex.getTagCount());
+        
+        patchNVMTags(data);
+    }
+    
+    return true;
+}
 
-    if (m_socType >= QCA_WCN3991 && !disableSoCLogging())
+bool QCASoCFirmware::checkTLVPatch(const u8 * data, const TlvRecord * record, s32 * dnldMode)
+{
+    const TlvPatch * tlv_patch = (const TlvPatch *) (data + record->offset);
+    
+    /* The index has made sure the header itself is there */
+    if ((u32) le32_to_cpu(tlv_patch->data_length) > record->length - sizeof( TlvPatch ))
     {
+        ErrorLog("Patch data overruns its record in %s (len: %d)!!!\n", m_fwFilename, le32_to_cpu(tlv_patch->data_length));
         return false;
     }
-
-    /* Perform HCI reset */
-    if (!resetDevice())
+    
+    if (tlv_patch->download_mode > QCA_SKIP_EVT_VSE_CC)
     {
+        ErrorLog("Unknown download mode (%d) in %s!!!\n", tlv_patch->download_mode, m_fwFilename);
         return false;
     }
 
-    //setBluetoothAddress...
+    /* For Rome version 1.1 to 3.1, all segment commands
+     * are acked by a vendor specific event (VSE).
+     * For Rome >= 3.2, the download mode field indicates
+     * if VSE is skipped by the controller.
+     * In case VSE is skipped, only the last segment is acked.
+     */
+    *dnldMode = tlv_patch->download_mode;
+
+    InfoLog("Total Length:                  %d bytes",      le32_to_cpu(tlv_patch->total_size));
+    InfoLog("Patch Data Length:             %d bytes",      le32_to_cpu(tlv_patch->data_length));
+    InfoLog("Signing Format Version:        0x%x",          tlv_patch->format_version);
+    InfoLog("Signature Algorithm:           0x%x",          tlv_patch->signature);
+    InfoLog("Download mode:                 0x%x",          tlv_patch->download_mode);
+    InfoLog("Product ID:                    0x%04x",        le16_to_cpu(tlv_patch->product_id));
+    InfoLog("Rom Build Version:             0x%04x",        le16_to_cpu(tlv_patch->rom_build));
+    InfoLog("Patch Version:                 0x%04x",        le16_to_cpu(tlv_patch->patch_version));
+    InfoLog("Patch Entry Address:           0x%x",          le32_to_cpu(tlv_patch->entry));
     
     return true;
 }
 
-bool QCASoCFirmware::getSoCVersion()
+/* Update NVM tags as needed. The image itself is read-only,
+ * changes go to the overlay and are applied while sending.
+ */
+void QCASoCFirmware::patchNVMTags(const u8 * data)
 {
-    EdlEventHdr   * edl;
+    const TlvTag * tag;
+    const TlvTag * hci;
     
-    u8 event_type = HCI_EV_VENDOR;
-    u8 rlen = sizeof( EdlEventHdr ) + sizeof( QCASoCVersion );
-    u8 rtype = EDL_APP_VER_RES_EVT;
-
-    /* Unlike other SoC's sending version command response as payload to
-     * VSE event. WCN3991 sends version command response as a payload to
-     * command complete event.
-    */
-    if (m_socType >= QCA_WCN3991)
+    if ((tag = hci = m_tlvIndex.findTag(EDL_TAG_ID_HCI)) && tag->len >= 3)
     {
-        event_type = 0;
-        ++rlen;
-        rtype = EDL_PATCH_VER_REQ_CMD;
-    }
+        /* HCI transport layer parameters
+         * enabling software inband sleep
+         * onto controller side.
+         */
+        if (m_inBandSleep)
+        {
+            m_tlvOverlay.setByte(tag->offset, data[tag->offset] | 0x80);
+        }
 
-    if (sendHCIRequest(EDL_PATCH_CMD_OPCODE, EDL_PATCH_CMD_LEN, (void *) EDL_PATCH_VER_REQ_CMD))
+        /* UART Baud Rate */
+        if (m_socType >= QCA_WCN3991)
+            m_tlvOverlay.setByte(tag->offset + 1, m_bdRate);
+        else
+            m_tlvOverlay.setByte(tag->offset + 2, m_bdRate);
+    }
+    
+    if ((tag = m_tlvIndex.findTag(EDL_TAG_ID_DEEP_SLEEP)) && tag->len >= 1 && m_deepSleep)
     {
-        ErrorLog("Failed to read version!!!\n");
-        return false;
+        /* Sleep enable mask
+         * enabling deep sleep feature on controller.
+         */
+        m_tlvOverlay.setByte(tag->offset, data[tag->offset] | 0x01);
     }
+    
+    applyNVMTagOverrides();
+    
+    /* Only what actually goes out tells whether the controller will sleep */
+    m_nvmInBandSleep = hci && hci->len >= 3 && (m_tlvOverlay.getByte(data, hci->offset) & 0x80);
+}
 
-    if (m_hciCommand->plen != rlen)
+void QCASoCFirmware::getNVMConfig()
+{
+    OSBoolean * inBandSleep = OSDynamicCast(OSBoolean, getProperty("InBandSleep"));
+    OSBoolean * deepSleep = OSDynamicCast(OSBoolean, getProperty("DeepSleep"));
+    OSNumber * baudRate = OSDynamicCast(OSNumber, getProperty("BaudRate"));
+    
+    m_inBandSleep = inBandSleep ? inBandSleep->isTrue() : true;
+    m_deepSleep = deepSleep ? deepSleep->isTrue() : true;
+    
+    /* The NVM carries the speed the UART runs at after setOperatingSpeed.
+     * A speed the controller has no code for would be sent as 115200
+     * while the host switched, so it is ignored.
+     */
+    if (baudRate && baudRate->unsigned32BitValue() != 115200 && getBaudRateValue(baudRate->unsigned32BitValue()) == QCA_BAUDRATE_115200)
     {
-        ErrorLog("Version size mismatch (len: %d)!!!\n", m_hciCommand->plen);
-        return false;
+        ErrorLog("Unsupported BaudRate %u, ignoring!!!\n", baudRate->unsigned32BitValue());
+        baudRate = NULL;
     }
-
-    edl = (EdlEventHdr *) m_hciCommand->pData;
     
-    if (!edl)
+    if (baudRate)
     {
-        ErrorLog("TLV has no header!!!\n");
-        return false;
+        m_operSpeed = baudRate->unsigned32BitValue();
     }
-
-    if (edl->cresp != EDL_CMD_REQ_RES_EVT || edl->rtype != rtype)
+    else if (m_pTransport)
     {
-        ErrorLog("Received wrong packet (cresp: %d, rtype: %d)!!!\n", edl->cresp, edl->rtype);
-        return false;
+        m_operSpeed = m_plan->operSpeed;
+    }
+    else
+    {
+        m_operSpeed = 0;
+    }
+    
+    if (m_operSpeed)
+    {
+        m_bdRate = getBaudRateValue(m_operSpeed);
     }
+}
 
-    if (m_socType >= QCA_WCN3991)
+/* UARTProtocol picks H4 (default) or H5, H5WindowSize its sliding window.
+ * H4 runs plain until in-band sleep is enabled, IBSIdleTimeout (ms) sets
+ * how long the link stays up without traffic.
+ */
+bool QCASoCFirmware::initUartTransport(IOSerialStreamSync * stream)
+{
+    OSString * protocol = OSDynamicCast(OSString, getProperty("UARTProtocol"));
+    OSNumber * window = OSDynamicCast(OSNumber, getProperty("H5WindowSize"));
+    OSNumber * idleTimeout = OSDynamicCast(OSNumber, getProperty("IBSIdleTimeout"));
+    
+    if (protocol && protocol->isEqualTo("H5"))
     {
-        memcpy(m_fwVersion, edl->data + 1, sizeof( QCASoCVersion ));
+        m_pTransport = new QCAH5Transport(stream, this, transportEventHandler, window ? window->unsigned8BitValue() : H5_DEFAULT_WINDOW);
     }
     else
     {
-        memcpy(m_fwVersion, &edl->data, sizeof( QCASoCVersion ));
+        m_pTransport = new QCAIbsTransport(stream, this, transportEventHandler, idleTimeout ? idleTimeout->unsigned32BitValue() : IBS_TX_IDLE_TIMEOUT);
     }
-
-    InfoLog("Product ID:        0x%08x", le32_to_cpu(m_fwVersion->product_id));
-    InfoLog("SOC Version:       0x%08x", le32_to_cpu(m_fwVersion->soc_id));
-    InfoLog("ROM Version:       0x%08x", le32_to_cpu(m_fwVersion->rom_ver));
-    InfoLog("Patch Version:     0x%08x", le32_to_cpu(m_fwVersion->patch_ver));
-
-    if (m_fwVersion->soc_id == 0 || m_fwVersion->rom_ver == 0)
+    
+    if (!m_pTransport || !m_pTransport->open(QCA_UART_INIT_SPEED))
     {
-        ErrorLog("Failed to get SoC version!!!\n");
+        safe_delete(m_pTransport);
         return false;
     }
     
+    InfoLog("Using %s transport at %u baud.\n", m_pTransport->getName(), (unsigned int) m_pTransport->getSpeed());
+    
     return true;
 }
 
-bool QCASoCFirmware::sendPreShutdownCommand()
+bool QCASoCFirmware::setOperatingSpeed()
 {
-    FuncLog("sendPreShutdownCommand");
+    u8 baud = getBaudRateValue(m_operSpeed);
     
-    if (sendHCIRequest(QCA_PRE_SHUTDOWN_CMD, 0, NULL))
+    if (!m_pTransport || !m_operSpeed || m_operSpeed == m_pTransport->getSpeed())
     {
-        ErrorLog("Failed to send pre-shutdown command!!!\n");
+        return true;
+    }
+    
+    InfoLog("Switching UART speed to %u...", (unsigned int) m_operSpeed);
+    
+    m_pCommandGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &QCASoCFirmware::flushEventsGated));
+    
+    /* The controller answers at the new speed, so switch the host side
+     * right after the command is out and only then wait for the answer.
+     */
+    if (submitHCIRequest(EDL_SET_BAUDRATE_CMD_OPCODE, sizeof(baud), &baud))
+    {
+        ErrorLog("Failed to send set baud rate command!!!\n");
         return false;
     }
-
+    
+    if (m_pTransport->setSpeed(m_operSpeed))
+    {
+        return false;
+    }
+    
+    if (m_socType >= QCA_WCN3990)
+    {
+        if (waitHCIReply(EDL_SET_BAUDRATE_CMD_OPCODE, HCI_EV_VENDOR, QCA_BAUDRATE_RSP_TIMEOUT) || !m_hciEventLen || m_hciEventData[0] != EDL_SET_BAUDRATE_RSP_EVT)
+        {
+            ErrorLog("Controller did not confirm baud rate change!!!\n");
+            return false;
+        }
+    }
+    else
+    {
+        IOSleep(QCA_BAUDRATE_SETTLE_TIME);
+    }
+    
+    if (getProvider())
+    {
+        getProvider()->setProperty(QCA_UART_SPEED_PROPERTY, m_operSpeed, 32);
+    }
+    
     return true;
 }
 
-void QCASoCFirmware::checkTLVData(OSData * fwData)
+/* NVMTagOverrides: { "<tag id>" = <data> } written over the start of the tag */
+void QCASoCFirmware::applyNVMTagOverrides()
 {
-    u16 tag_id, tag_len;
-
-    TlvHdr * tlv = (TlvHdr *) fwData;
-
-    u32 type_len = le32_to_cpu(tlv->type_len);
-    int length = (type_len >> 8) & 0x00ffffff;
-
-    InfoLog("TLV Type:                      0x%x",      type_len & 0x000000ff);
-    InfoLog("Length:                        %d bytes",  length);
-
-    m_dnldMode = QCA_SKIP_EVT_NONE;
-
-    switch (m_tlvType)
+    OSDictionary * overrides = OSDynamicCast(OSDictionary, getProperty("NVMTagOverrides"));
+    OSCollectionIterator * iterator;
+    const OSSymbol * key;
+    const TlvTag * tag;
+    OSData * value;
+    
+    if (!overrides || !(iterator = OSCollectionIterator::withCollection(overrides)))
+    {
+        return;
+    }
+    
+    while ((key = OSDynamicCast(OSSymbol, iterator->getNextObject())))
     {
-        case TLV_TYPE_PATCH:
+        u16 id = (u16) strtoul(key->getCStringNoCopy(), NULL, 0);
+        value = OSDynamicCast(OSData, overrides->getObject(key));
+        tag = m_tlvIndex.findTag(id);
+        
+        if (!value || !tag || value->getLength() > tag->len)
         {
-            TlvPatch * tlv_patch = (TlvPatch *) tlv->data;
-
-            /* For Rome version 1.1 to 3.1, all segment commands
-             * are acked by a vendor specific event (VSE).
-             * For Rome >= 3.2, the download mode field indicates
-             * if VSE is skipped by the controller.
-             * In case VSE is skipped, only the last segment is acked.
-             */
-            
-            m_dnldMode = tlv_patch->download_mode;
-
-            InfoLog("Total Length:                  %d bytes",      le32_to_cpu(tlv_patch->total_size));
-            InfoLog("Patch Data Length:             %d bytes",      le32_to_cpu(tlv_patch->data_length));
-            InfoLog("Signing Format Version:        0x%x",          le32_to_cpu(tlv_patch->format_version));
-            InfoLog("Signature Algorithm:           0x%x",          tlv_patch->signature);
-            InfoLog("Download mode:                 0x%x",          tlv_patch->download_mode);
-            InfoLog("Product ID:                    0x%04x",        le16_to_cpu(tlv_patch->product_id));
-            InfoLog("Rom Build Version:             0x%04x",        le16_to_cpu(tlv_patch->rom_build));
-            InfoLog("Patch Version:                 0x%04x",        le16_to_cpu(tlv_patch->patch_version));
-            InfoLog("Patch Entry Address:           0x%x",          le32_to_cpu(tlv_patch->entry));
-            break;
+            ErrorLog("Ignoring override for NVM tag %s!!!\n", key->getCStringNoCopy());
+            continue;
         }
-
-        case TLV_TYPE_NVM:
+        
+        /* One overlay patch per tag, so no longer than a patch can hold */
+        if (value->getLength() > TLV_OVERLAY_MAX_PATCH_LEN)
         {
-            TlvNvm * tlv_nvm;
-            int i = 0;
-            while (i < length) {
-                tlv_nvm = (TlvNvm *) (tlv->data + i);
-
-                tag_id  = le16_to_cpu(tlv_nvm->tag_id);
-                tag_len = le16_to_cpu(tlv_nvm->tag_len);
-
-                /* Update NVM tags as needed */
-                switch (tag_id)
-                {
-                    case EDL_TAG_ID_HCI:
-                    {
-                        /* HCI transport layer parameters
-                         * enabling software inband sleep
-                         * onto controller side.
-                         */
-                        tlv_nvm->data[0] |= 0x80;
-
-                        /* UART Baud Rate */
-                        if (m_socType >= QCA_WCN3991)
-                            tlv_nvm->data[1] = m_bdRate;
-                        else
-                            tlv_nvm->data[2] = m_bdRate;
-
-                        break;
-                    }
-                    case EDL_TAG_ID_DEEP_SLEEP:
-                    {
-                        /* Sleep enable mask
-                         * enabling deep sleep feature on controller.
-                         */
-                        tlv_nvm->data[0] |= 0x01;
-
-                        break;
-                    }
-                    default:
-                    {
-                        ErrorLog("Tag ID invalid!!!\n");
-                        break;
-                    }
-                }
-
-                i += (sizeof(u16) + sizeof(u16) + 8 + tag_len);
-            }
-            break;
+            ErrorLog("Override for NVM tag %s is %u bytes, at most %d fit!!!\n", key->getCStringNoCopy(), value->getLength(), TLV_OVERLAY_MAX_PATCH_LEN);
+            continue;
         }
-
-        default:
+        
+        if (!m_tlvOverlay.set(tag->offset, value->getBytesNoCopy(), (u8) value->getLength()))
         {
-            ErrorLog("Unknown TLV type (%d)!!!", m_tlvType);
-            break;
+            ErrorLog("Ignoring override for NVM tag %s!!!\n", key->getCStringNoCopy());
+            continue;
         }
+        
+        InfoLog("Overriding NVM tag %d (%u bytes).\n", id, value->getLength());
     }
+    
+    OSSafeReleaseNULL(iterator);
 }
 
-bool QCASoCFirmware::sendTLVSegment(int seg_size, const u8 * data)
+bool QCASoCFirmware::sendTLVSegment(int seg_size, const u8 * data, bool wait, u32 offset)
 {
-    EdlEventHdr *edl;
+    u8 * payload = getEdlPayloadBuffer(EDL_PATCH_CMD_OPCODE, EDL_PATCH_TLV_REQ_CMD, seg_size);
     
-    u8 * tlv_resp;
-    u8 cmd[MAX_SIZE_PER_TLV_SEGMENT + 2];
-    u8 event_type = HCI_EV_VENDOR;
-    u8 rlen = sizeof( EdlEventHdr ) + sizeof( u8 );
-    u8 rtype = EDL_TVL_DNLD_RES_EVT;
-
-    cmd[0] = EDL_PATCH_TLV_REQ_CMD;
-    cmd[1] = seg_size;
-    memcpy(cmd + 2, data, seg_size);
-
-    if (m_dnldMode == QCA_SKIP_EVT_VSE_CC || m_dnldMode == QCA_SKIP_EVT_VSE)
-    {
-        return sendHCIRequest(EDL_PATCH_CMD_OPCODE, seg_size + 2, cmd);
-    }
-
-    /* Unlike other SoC's sending version command response as payload to
-     * VSE event. WCN3991 sends version command response as a payload to
-     * command complete event.
-     */
-    if (m_socType >= QCA_WCN3991)
-    {
-        event_type = 0;
-        rlen = sizeof( EdlEventHdr );
-        rtype = EDL_PATCH_TLV_REQ_CMD;
-    }
-
-    if (sendHCIRequest(EDL_PATCH_CMD_OPCODE, seg_size + 2, cmd))
+    if (!payload)
     {
-        ErrorLog("Failed to send TLV segment!!!\n");
         return false;
     }
+    
+    /* Copied once into the command, the overlay patches that copy */
+    memcpy(payload, data, seg_size);
+    m_tlvOverlay.apply(offset, payload, seg_size);
 
-    if (m_hciCommand->plen != rlen)
+    /* No reply is sent for this segment, so do not wait for one */
+    if (m_dnldMode == QCA_SKIP_EVT_VSE_CC || m_dnldMode == QCA_SKIP_EVT_VSE)
     {
-        ErrorLog("TLV response size mismatch!!!\n");
-        return false;
+        return !submitEdlPayload(EDL_PATCH_CMD_OPCODE, payload, seg_size, kUSBHostStandardRequestCompletionTimeout);
     }
 
-    edl = (EdlEventHdr *) m_hciCommand->pData;
-    if (!edl)
+    if (submitEdlPayload(EDL_PATCH_CMD_OPCODE, payload, seg_size))
     {
-        ErrorLog("TLV has no header!!!\n");
+        ErrorLog("Failed to send TLV segment!!!\n");
         return false;
     }
 
-    if (edl->cresp != EDL_CMD_REQ_RES_EVT || edl->rtype != rtype)
+    if (wait && waitEdlReply(EDL_PATCH_CMD_OPCODE, EDL_PATCH_TLV_REQ_CMD))
     {
-        ErrorLog("TLV with error (stat: 0x%x, rtype: 0x%x)!!!", edl->cresp, edl->rtype);
+        ErrorLog("Failed to receive TLV segment response!!!\n");
         return false;
     }
+    
+    return true;
+}
 
-    if (m_socType >= QCA_WCN3991)
-    {
-        return true;
-    }
-
-    tlv_resp = (u8 *) edl->data;
-    if (* tlv_resp)
+/* The size the reference driver sends, unless TLVSegmentSize says the
+ * controller takes larger segments.
+ */
+u16 QCASoCFirmware::getTLVSegmentSize()
+{
+    OSNumber * segSize = OSDynamicCast(OSNumber, getProperty("TLVSegmentSize"));
+    
+    if (segSize && segSize->unsigned32BitValue())
     {
-        ErrorLog("TLV with error (stat: 0x%x, rtype: 0x%x, tlv_resp: 0x%x)!!!", edl->cresp, edl->rtype, * tlv_resp);
+        return min(segSize->unsigned32BitValue(), MAX_SIZE_TLV_SEGMENT_LIMIT);
     }
-    return true;
+    
+    return MAX_SIZE_PER_TLV_SEGMENT;
 }
 
 bool QCASoCFirmware::disableSoCLogging()
@@ -356,99 +1117,176 @@ bool QCASoCFirmware::disableSoCLogging()
     return true;
 }
 
-void QCASoCFirmware::getRamPatchName()
+const QCASoCPlan * QCASoCFirmware::findSoCPlan(const QCASoCVersion * version)
 {
-    m_tlvType = TLV_TYPE_PATCH;
-    u8 romVersion = ((GET_SOC_VERSION(m_fwVersion->soc_id, m_fwVersion->rom_ver) & 0x00000f00) >> 0x04) | (GET_SOC_VERSION(m_fwVersion->soc_id, m_fwVersion->rom_ver) & 0x0000000f);
+    u32 socId = le32_to_cpu(version->soc_id);
+    u16 romVer = le16_to_cpu(version->rom_ver);
     
-    if (m_fwVersion->soc_id == QCA_WCN3990 || m_fwVersion->soc_id == QCA_WCN3998 || m_fwVersion->soc_id == QCA_WCN3991)
-    {
-        snprintf(m_fwFilename, sizeof(m_fwFilename), "crbtfw%02x.tlv", romVersion);
-    }
-    else if (m_fwVersion->soc_id == QCA_QCA6390)
-    {
-        snprintf(m_fwFilename, sizeof(m_fwFilename), "htbtfw%02x.tlv", romVersion);
-    }
-    else
+    for (int i = 0; i < ARRAY_SIZE(SoCPlans); ++i)
     {
-        snprintf(m_fwFilename, sizeof(m_fwFilename), "rampatch_%08x.bin", GET_SOC_VERSION(m_fwVersion->soc_id, m_fwVersion->rom_ver));
+        if ((SoCPlans[i].socType == QCA_INVALID || SoCPlans[i].socType == m_socType) &&
+            (socId & SoCPlans[i].socIdMask) == SoCPlans[i].socId &&
+            romVer == SoCPlans[i].romVer)
+        {
+            DebugLog("(findSoCPlan) Using %s and %s.\n", SoCPlans[i].rampatch, SoCPlans[i].nvm);
+            return &SoCPlans[i];
+        }
     }
+    
+    ErrorLog("(findSoCPlan) Unsupported SoC (soc_id: 0x%08x, rom_ver: 0x%04x)!!!\n", socId, romVer);
+    return NULL;
 }
 
-void QCASoCFirmware::getNVMName()
+/* Cuts every unit into the segments it goes out as, so the download loop
+ * only walks the list. The segment size is settled by then and holds for
+ * the whole download.
+ */
+bool QCASoCFirmware::buildTLVSegments()
 {
-    m_tlvType = TLV_TYPE_NVM;
-    if (m_fwVersion->soc_id == QCA_WCN3991)
+    u16 segmax = getTLVSegmentSize();
+    TlvDownloadUnit * unit;
+    TlvSegment * seg;
+    u32 count = 0;
+    u32 offset, remain;
+    
+    releaseTLVSegments();
+    
+    for (u32 u = 0; u < m_tlvUnitCount; ++u)
     {
-         snprintf(m_fwFilename, sizeof(m_fwFilename), "crnv%02xu.bin", le32_to_cpu(m_fwVersion->rom_ver));
+        count += (m_tlvUnits[u].length + segmax - 1) / segmax;
     }
-    else if (m_fwVersion->soc_id == QCA_WCN3990 || m_fwVersion->soc_id == QCA_WCN3998)
+    
+    if (!count || !(m_tlvSegments = (TlvSegment *) IOMalloc(count * sizeof(TlvSegment))))
     {
-            snprintf(m_fwFilename, sizeof(m_fwFilename), "crnv%02x.bin", le32_to_cpu(m_fwVersion->rom_ver));
+        ErrorLog("Failed to allocate %u TLV segments!!!\n", (unsigned int) count);
+        return false;
     }
-    else if (m_fwVersion->soc_id == QCA_QCA6390)
+    
+    m_tlvSegmentCount = count;
+    seg = m_tlvSegments;
+    
+    for (u32 u = 0; u < m_tlvUnitCount; ++u)
     {
-        snprintf(m_fwFilename, sizeof(m_fwFilename), "htnv%02x.bin", le32_to_cpu(m_fwVersion->rom_ver));
+        unit = &m_tlvUnits[u];
+        unit->firstSegment = (u32) (seg - m_tlvSegments);
+        unit->segmentCount = 0;
+        
+        for (offset = unit->offset, remain = unit->length; remain; ++seg, ++unit->segmentCount)
+        {
+            seg->offset = offset;
+            seg->length = (u8) min(segmax, remain);
+            
+            offset += seg->length;
+            remain -= seg->length;
+            
+            /* The last segment is always acked regardless download mode */
+            seg->dnldMode = remain ? unit->dnldMode : QCA_SKIP_EVT_NONE;
+        }
     }
-    else
+    
+    return true;
+}
+
+void QCASoCFirmware::releaseTLVSegments()
+{
+    if (m_tlvSegments)
     {
-        snprintf(m_fwFilename, sizeof(m_fwFilename), "nvm_%08x.bin", GET_SOC_VERSION(m_fwVersion->soc_id, m_fwVersion->rom_ver));
+        IOFree(m_tlvSegments, m_tlvSegmentCount * sizeof(TlvSegment));
+        m_tlvSegments = NULL;
     }
+    m_tlvSegmentCount = 0;
 }
 
 bool QCASoCFirmware::loadSoCFirmware(OSData * fwData)
 {
     InfoLog("Downloading firmware %s...", m_fwFilename);
 
-    checkTLVData(fwData);
-
-    u8 * segment = (u8 *) fwData->getBytesNoCopy();
-    int remain = fwData->getLength();
-    int segsize, i = 0;
+    if (!checkTLVData(fwData) || !buildTLVSegments())
+    {
+        OSSafeReleaseNULL(fwData);
+        return false;
+    }
     
-    while (remain > 0)
+    const u8 * data = (const u8 *) fwData->getBytesNoCopy();
+    const TlvDownloadUnit * unit;
+    const TlvSegment * seg;
+    u32 inflight = 0;
+    bool last;
+    bool ret = true;
+    
+    for (u32 u = 0; ret && u < m_tlvUnitCount; ++u)
     {
-        segsize = min(MAX_SIZE_PER_TLV_SEGMENT, remain);
-
-        InfoLog("Sending segment %d (size: %d)...", ++i, segsize);
-
-        remain -= segsize;
-        
-        /* The last segment is always acked regardless download mode */
-        if (!remain || segsize < MAX_SIZE_PER_TLV_SEGMENT)
+        /* Only replies to this record's segments may complete its waits */
+        if (m_pCommandGate)
         {
-            m_dnldMode = QCA_SKIP_EVT_NONE;
+            m_pCommandGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &QCASoCFirmware::flushEventsGated));
         }
-
-        if (!sendTLVSegment(segsize, segment))
+        
+        unit = &m_tlvUnits[u];
+        
+        if (m_tlvUnitCount > 1)
         {
-            OSSafeReleaseNULL(fwData);
-            return false;
+            InfoLog("Sending TLV record %d of %d (type: %d)...", u + 1, m_tlvUnitCount, unit->type);
         }
+        
+        for (u32 k = 0; ret && k < unit->segmentCount; ++k)
+        {
+            seg = &m_tlvSegments[unit->firstSegment + k];
+            last = k + 1 == unit->segmentCount;
+            m_dnldMode = seg->dnldMode;
 
-        segment += segsize;
-    }
+            InfoLog("Sending segment %d (size: %d)...", unit->firstSegment + k + 1, seg->length);
 
-    /* Latest qualcomm chipsets are not sending a command complete event
-     * for every fw packet sent. They only respond with a vendor specific
-     * event for the last packet. This optimization in the chip will
-     * decrease the BT in initialization time. Here we will inject a command
-     * complete event to avoid a command timeout error message.
-     */
-    if (m_dnldMode == QCA_SKIP_EVT_VSE_CC || m_dnldMode == QCA_SKIP_EVT_VSE)
-    {
-        OSSafeReleaseNULL(fwData);
-        //Inject HCI_EV_CMD_COMPLETE
-        return true;
+            if (!sendTLVSegment(seg->length, data + seg->offset, false, seg->offset))
+            {
+                ret = false;
+                break;
+            }
+            
+            if (m_dnldMode == QCA_SKIP_EVT_NONE || m_dnldMode == QCA_SKIP_EVT_CC)
+            {
+                ++inflight;
+            }
+            
+            /* Keep up to m_edlPipelineDepth segments waiting for their ack,
+             * replies come back in order so the oldest is always next. Each
+             * record is drained before the next one starts.
+             */
+            while (inflight && (inflight >= m_edlPipelineDepth || last))
+            {
+                if (waitEdlReply(EDL_PATCH_CMD_OPCODE, EDL_PATCH_TLV_REQ_CMD))
+                {
+                    ErrorLog("Failed to receive TLV segment response!!!\n");
+                    ret = false;
+                    break;
+                }
+                --inflight;
+            }
+        }
+        
+        /* In the skip modes the controller sends no Command Complete for the
+         * segments, inject one for whoever follows the event stream. The
+         * next record flushes it, and with no EDL header it never passes
+         * for a segment reply.
+         */
+        if (ret && (unit->dnldMode == QCA_SKIP_EVT_VSE_CC || unit->dnldMode == QCA_SKIP_EVT_VSE))
+        {
+            if (injectCommandComplete(QCA_HCI_CC_OPCODE, QCA_HCI_CC_SUCCESS))
+            {
+                ErrorLog("Failed to inject command complete event!!!\n");
+            }
+        }
     }
 
+    releaseTLVSegments();
     OSSafeReleaseNULL(fwData);
-    return true;
+    return ret;
 }
 
 bool QCASoCFirmware::loadRamPatch()
 {
-    getRamPatchName();
+    m_tlvType = TLV_TYPE_PATCH;
+    strlcpy(m_fwFilename, m_plan->rampatch, sizeof(m_fwFilename));
     
     m_fwData = getFwDescByName(m_fwFilename);
     
@@ -458,7 +1296,22 @@ bool QCASoCFirmware::loadRamPatch()
         return false;
     }
 
-    if (!loadSoCFirmware(m_fwData))
+    /* A ticket on the hub for the USB SoC, UART goes straight through */
+    int ticket;
+    
+    if (!scheduleDownload(m_fwData->getLength(), &ticket))
+    {
+        OSSafeReleaseNULL(m_fwData);
+        return false;
+    }
+    
+    bool loaded = loadSoCFirmware(m_fwData);
+    
+    /* loadSoCFirmware dropped the reference */
+    m_fwData = NULL;
+    finishDownload(ticket);
+    
+    if (!loaded)
     {
         ErrorLog("Failed to load ram patch file!!!\n");
         return false;
@@ -468,7 +1321,8 @@ bool QCASoCFirmware::loadRamPatch()
 
 bool QCASoCFirmware::loadNVM()
 {
-    getNVMName();
+    m_tlvType = TLV_TYPE_NVM;
+    strlcpy(m_fwFilename, m_plan->nvm, sizeof(m_fwFilename));
 
     m_fwData = getFwDescByName(m_fwFilename);
     
@@ -478,7 +1332,22 @@ bool QCASoCFirmware::loadNVM()
         return false;
     }
     
-    if (!loadSoCFirmware(m_fwData))
+    /* A ticket on the hub for the USB SoC, UART goes straight through */
+    int ticket;
+    
+    if (!scheduleDownload(m_fwData->getLength(), &ticket))
+    {
+        OSSafeReleaseNULL(m_fwData);
+        return false;
+    }
+    
+    bool loaded = loadSoCFirmware(m_fwData);
+    
+    /* loadSoCFirmware dropped the reference */
+    m_fwData = NULL;
+    finishDownload(ticket);
+    
+    if (!loaded)
     {
         ErrorLog("Failed to load NVM file!!!\n");
         return false;
@@ -488,15 +1357,14 @@ bool QCASoCFirmware::loadNVM()
 
 IOReturn QCASoCFirmware::setBluetoothDeviceAddressROME(bdaddr_t bdaddr)
 {
-    u8 cmd[9];
+    u8 cmd[8];
 
-    cmd[0] = EDL_NVM_ACCESS_SET_REQ_CMD;
-    cmd[1] = 0x02;                  /* TAG ID */
-    cmd[2] = sizeof(bdaddr_t);      /*  size  */
+    cmd[0] = 0x02;                  /* TAG ID */
+    cmd[1] = sizeof(bdaddr_t);      /*  size  */
     
-    memcpy(cmd + 3, bdaddr, sizeof(bdaddr_t));
+    memcpy(cmd + 2, &bdaddr, sizeof(bdaddr_t));
     
-    return sendHCIRequest(EDL_NVM_ACCESS_OPCODE, sizeof(cmd), cmd);
+    return sendEdlRequest(EDL_NVM_ACCESS_OPCODE, EDL_NVM_ACCESS_SET_REQ_CMD, cmd, sizeof(cmd));
 }
 
 inline IOReturn QCASoCFirmware::setBluetoothDeviceAddress(const bdaddr_t *bdaddr)
@@ -10,17 +10,26 @@
 #define QCASoCFirmware_hpp
 
 #include "QCABluetoothFirmware.hpp"
+#include "QCATlvIndex.hpp"
+#include "QCATlvOverlay.hpp"
+#include "QCAUartTransport.hpp"
+#include "QCAH5Transport.hpp"
+#include "QCAIbsTransport.hpp"
 
 #define GET_SOC_VERSION(socID, romVersion)  (le32_to_cpu(socID) << 16) | (le16_to_cpu(romVersion))
 
 #define EDL_PATCH_CMD_OPCODE            0xFC00
 #define EDL_NVM_ACCESS_OPCODE           0xFC0B
 #define EDL_WRITE_BD_ADDR_OPCODE        0xFC14
+#define EDL_SET_BAUDRATE_CMD_OPCODE     0xFC48
 #define EDL_PATCH_CMD_LEN               1
 #define EDL_PATCH_VER_REQ_CMD           0x19
 #define EDL_PATCH_TLV_REQ_CMD           0x1E
+#define EDL_GET_BUILD_INFO_CMD          0x20
 #define EDL_NVM_ACCESS_SET_REQ_CMD      0x01
 #define MAX_SIZE_PER_TLV_SEGMENT        243
+#define EDL_TLV_SEGMENT_HDR_SIZE        2       /* sub command and length */
+#define MAX_SIZE_TLV_SEGMENT_LIMIT      (HCI_MAX_COMMAND_PLEN - EDL_TLV_SEGMENT_HDR_SIZE)
 #define QCA_PRE_SHUTDOWN_CMD            0xFC08
 #define QCA_DISABLE_LOGGING             0xFC17
 
@@ -38,11 +47,87 @@
 
 #define QCA_WCN3990_POWERON_PULSE       0xFC
 #define QCA_WCN3990_POWEROFF_PULSE      0xC0
+#define QCA_WCN3990_POWEROFF_SPEED      2400
+#define QCA_WCN3990_BOOT_TIME           100     /* ms after the power on pulse */
+
+#define QCA_WAKE_SETTLE_TIME            (30 * 1000 * 1000)  /* us, wake bring-up with a full download */
+
+#define QCA_PRE_SHUTDOWN_TIMEOUT        100     /* ms, the SoC goes down either way */
+#define QCA_PRE_SHUTDOWN_DELAY          10      /* ms before cutting power */
 
 #define QCA_WCN3991_SOC_ID              0x40014320
 
 #define QCA_FW_BUILD_VER_LEN            255
 
+/* Kept on the provider, which outlives this driver across a warm re-probe */
+#define QCA_FW_BUILD_PROPERTY           "QCAFirmwareBuild"
+#define QCA_FW_VERSION_PROPERTY         "QCAFirmwareVersion"
+#define QCA_FW_IMAGE_PROPERTY           "QCAFirmwareImage"
+#define QCA_UART_SPEED_PROPERTY         "QCAUartSpeed"
+
+#define EDL_RTYPE_ANY                   0xFF
+#define EDL_ROUTE_LEN_PREFIX            0x01    /* request carries a length byte after the sub command */
+#define EDL_ROUTE_RESULT                0x02    /* first payload byte of a VSE reply is a result code */
+
+#define QCA_EDL_PIPELINE_DEPTH          1
+
+#define QCA_UART_OPER_SPEED             3000000
+#define QCA_WCN399X_UART_OPER_SPEED     3200000
+#define QCA_BAUDRATE_RSP_TIMEOUT        100     /* ms */
+#define QCA_BAUDRATE_SETTLE_TIME        300     /* ms, for SoC's that do not confirm */
+
+#define QCA_SOC_ID_WCN399X              0x40010000
+#define QCA_SOC_ID_FAMILY_MASK          0xffff0000
+#define QCA_SOC_ID_EXACT_MASK           0xffffffff
+
+/* Everything bring-up needs to know about one SoC revision */
+struct QCASoCPlan
+{
+    int             socType;        /* QCA_INVALID matches any */
+    u32             socId;
+    u32             socIdMask;      /* 0 matches any soc_id */
+    u16             romVer;
+    const char  *   rampatch;
+    const char  *   nvm;
+    s32             dnldMode;       /* until a patch header says otherwise */
+    bool            replyInCC;      /* EDL replies come in a command complete */
+    bool            disableLogging;
+    bool            buildInfo;      /* answers EDL_GET_BUILD_INFO_CMD */
+    u32             operSpeed;      /* UART speed after the version is read */
+};
+
+/* One TLV record as it goes out, header included. Containers are
+ * flattened, so every record is downloaded as a TLV of its own.
+ */
+struct TlvDownloadUnit
+{
+    u8          type;
+    u32         offset;         /* of the record header in the blob */
+    u32         length;         /* header and payload */
+    s32         dnldMode;
+    u32         firstSegment;   /* in m_tlvSegments */
+    u32         segmentCount;
+};
+
+/* One EDL command's worth of a download unit */
+struct TlvSegment
+{
+    u32         offset;         /* in the blob */
+    u8          length;
+    u8          dnldMode;       /* QCA_SKIP_EVT_NONE for the last one of a unit */
+};
+
+/* How the controller answers an EDL request */
+struct EdlRoute
+{
+    u16         opcode;
+    u8          subCmd;
+    u8          vseRtype;       /* rtype when the reply is a vendor specific event */
+    u8          ccRtype;        /* rtype when the reply is a command complete */
+    u8          ccOffset;       /* bytes ahead of the payload in a command complete reply */
+    u8          flags;
+};
+
 static inline uint8_t getBaudRateValue(int speed)
 {
     switch (speed)
@@ -86,19 +171,71 @@ class QCASoCFirmware : public QCABluetoothFirmware
     
 public:
     virtual bool start( IOService * provider ) override;
+    virtual void stop( IOService * provider ) override;
+    virtual IOReturn setPowerState( unsigned long powerStateOrdinal, IOService * whatDevice ) override;
+    
+protected:
+    virtual bool isProvisioned() override;
+    virtual bool bringUpDevice() override;
+    virtual bool isHCIReply(u16 opCode, const u8 * params, u8 len) override;
     
 private:
-    bool sendPreShutdownCommand();
-    void checkTLVData(OSData * fwData);
-    bool sendTLVSegment(int seg_size, const u8 *data);
+    bool bringUp();
+    bool powerOn();
+    void powerOff(bool cutPower);
+    bool hasPowerPulse()        { return m_pTransport && m_socType >= QCA_WCN3990 && m_socType <= QCA_WCN3991; }
+    
+    const EdlRoute * getEdlRoute(u16 opcode, u8 subCmd);
+    bool edlRepliesInCC();
+    u8 * getEdlPayloadBuffer(u16 opcode, u8 subCmd, u8 len);
+    IOReturn submitEdlPayload(u16 opcode, const u8 * payload, u8 len, UInt32 timeout = HCI_INIT_TIMEOUT);
+    IOReturn submitEdlRequest(u16 opcode, u8 subCmd, const void * data, u8 len, UInt32 timeout = HCI_INIT_TIMEOUT);
+    IOReturn waitEdlReply(u16 opcode, u8 subCmd, const u8 ** payload = NULL, u8 * payloadLen = NULL, UInt32 timeout = HCI_INIT_TIMEOUT);
+    IOReturn waitEdlReplyUntil(u16 opcode, u8 subCmd, UInt64 deadline, const u8 ** payload = NULL, u8 * payloadLen = NULL);
+    IOReturn sendEdlRequest(u16 opcode, u8 subCmd, const void * data, u8 len, const u8 ** payload = NULL, u8 * payloadLen = NULL, UInt32 timeout = HCI_INIT_TIMEOUT);
+    
+    bool initUartTransport(IOSerialStreamSync * stream);
+    bool setOperatingSpeed();
+    
+    bool sendPreShutdownCommand(UInt32 timeout = HCI_INIT_TIMEOUT);
+    bool checkTLVData(OSData * fwData);
+    bool checkTLVPatch(const u8 * data, const TlvRecord * record, s32 * dnldMode);
+    bool buildTLVSegments();
+    void releaseTLVSegments();
+    void patchNVMTags(const u8 * data);
+    void getNVMConfig();
+    void applyNVMTagOverrides();
+    bool sendTLVSegment(int seg_size, const u8 *data, bool wait = true, u32 offset = 0);
+    u16 getTLVSegmentSize();
     bool disableSoCLogging();
     bool getSoCVersion();
+    bool readSoCVersion();
+    u32 getLastSpeed();
+    bool getBuildInfo(char * build, u32 size);
+    bool getImageKey(u32 * key);
+    void cacheFirmwareBuild();
+    void clearFirmwareBuild();
+    const QCASoCPlan * findSoCPlan(const QCASoCVersion * version);
     bool loadSoCFirmware(OSData * fwData);
-    void getRamPatchName();
-    void getNVMName();
     bool loadRamPatch();
     bool loadNVM();
     IOReturn setBluetoothDeviceAddressROME(bdaddr_t bdaddr);
     IOReturn setBluetoothDeviceAddress(bdaddr_t bdaddr);
+    
+    const QCASoCPlan * m_plan;
+    bool m_poweredOff;
+    u32 m_edlPipelineDepth;
+    u8 m_edlRtype;              /* of the EDL reply being waited for, EDL_RTYPE_ANY if none */
+    QCATlvIndex m_tlvIndex;
+    QCATlvOverlay m_tlvOverlay;
+    TlvDownloadUnit m_tlvUnits[TLV_MAX_RECORDS];
+    u32 m_tlvUnitCount;
+    TlvSegment * m_tlvSegments;
+    u32 m_tlvSegmentCount;
+    bool m_inBandSleep;
+    bool m_nvmInBandSleep;      /* set in the HCI tag of the last NVM sent */
+    u32 m_imageKey;
+    bool m_deepSleep;
+    u32 m_operSpeed;
 };
 #endif /* QCASoCFirmware_hpp */
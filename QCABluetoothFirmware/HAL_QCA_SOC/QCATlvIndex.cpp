@@ -0,0 +1,201 @@
+//
+//  QCATlvIndex.cpp
+//  QCABluetoothFirmware
+//
+//  Copyright © 2021 cjiang. All rights reserved.
+//
+
+#include "QCATlvIndex.hpp"
+
+void QCATlvIndex::reset()
+{
+    m_data = NULL;
+    m_size = 0;
+    m_recordCount = 0;
+    m_tagCount = 0;
+    m_patchOffset = 0;
+    bzero(m_tagMap, sizeof(m_tagMap));
+}
+
+bool QCATlvIndex::parse(const u8 * data, u32 size)
+{
+    reset();
+
+    if (!data || size < TLV_HDR_SIZE)
+    {
+        ErrorLog("(parse) TLV blob is too short (size: %u)!!!\n", (unsigned int) size);
+        return false;
+    }
+
+    m_data = data;
+    m_size = size;
+
+    if (!parseRecords(0, size, false))
+    {
+        reset();
+        return false;
+    }
+
+    return true;
+}
+
+bool QCATlvIndex::parseRecords(u32 offset, u32 end, bool nested)
+{
+    while (offset < end)
+    {
+        if (end - offset < TLV_HDR_SIZE)
+        {
+            ErrorLog("(parseRecords) Truncated TLV header at offset %u!!!\n", (unsigned int) offset);
+            return false;
+        }
+
+        u32 type_len = get_unaligned_le32(m_data + offset);
+        u8 type = TLV_GET_TYPE(type_len);
+        u32 length = TLV_GET_LENGTH(type_len);
+
+        offset += TLV_HDR_SIZE;
+
+        if (length > end - offset)
+        {
+            ErrorLog("(parseRecords) TLV record of type %d overruns the blob (len: %u)!!!\n", type, (unsigned int) length);
+            return false;
+        }
+
+        /* Containers hold whole records, but never other containers */
+        if (type == TLV_TYPE_MULTI && !nested)
+        {
+            if (!parseRecords(offset, offset + length, true))
+            {
+                return false;
+            }
+            offset += length;
+            continue;
+        }
+
+        if (m_recordCount == TLV_MAX_RECORDS)
+        {
+            ErrorLog("(parseRecords) Too many TLV records!!!\n");
+            return false;
+        }
+
+        m_records[m_recordCount].type = type;
+        m_records[m_recordCount].offset = offset;
+        m_records[m_recordCount].length = length;
+        ++m_recordCount;
+
+        switch (type)
+        {
+            case TLV_TYPE_PATCH:
+            {
+                if (length < sizeof( TlvPatch ))
+                {
+                    ErrorLog("(parseRecords) Patch header is truncated!!!\n");
+                    return false;
+                }
+
+                if (!m_patchOffset)
+                {
+                    m_patchOffset = offset;
+                }
+                break;
+            }
+            case TLV_TYPE_NVM:
+            {
+                if (!parseNvmTags(offset, length))
+                {
+                    return false;
+                }
+                break;
+            }
+            default:
+            {
+                break;
+            }
+        }
+
+        offset += length;
+    }
+
+    return true;
+}
+
+bool QCATlvIndex::parseNvmTags(u32 offset, u32 length)
+{
+    u32 end = offset + length;
+
+    while (offset < end)
+    {
+        if (end - offset < TLV_NVM_TAG_HDR_SIZE)
+        {
+            ErrorLog("(parseNvmTags) Truncated NVM tag at offset %u!!!\n", (unsigned int) offset);
+            return false;
+        }
+
+        const TlvNvm * tag = (const TlvNvm *) (m_data + offset);
+        u16 id = le16_to_cpu(tag->tag_id);
+        u16 len = le16_to_cpu(tag->tag_len);
+
+        offset += TLV_NVM_TAG_HDR_SIZE;
+
+        if (len > end - offset)
+        {
+            ErrorLog("(parseNvmTags) NVM tag %d overruns its record (len: %d)!!!\n", id, len);
+            return false;
+        }
+
+        if (m_tagCount == TLV_MAX_TAGS)
+        {
+            ErrorLog("(parseNvmTags) Too many NVM tags!!!\n");
+            return false;
+        }
+
+        m_tags[m_tagCount].id = id;
+        m_tags[m_tagCount].len = len;
+        m_tags[m_tagCount].offset = offset;
+
+        /* First occurrence wins, as with the controller */
+        if (id < TLV_TAG_MAP_SIZE && !m_tagMap[id])
+        {
+            m_tagMap[id] = m_tagCount + 1;
+        }
+
+        ++m_tagCount;
+        offset += len;
+    }
+
+    return true;
+}
+
+const TlvRecord * QCATlvIndex::findRecord(u8 type) const
+{
+    for (u32 i = 0; i < m_recordCount; ++i)
+    {
+        if (m_records[i].type == type)
+        {
+            return &m_records[i];
+        }
+    }
+    return NULL;
+}
+
+const TlvPatch * QCATlvIndex::getPatchHeader() const
+{
+    return m_patchOffset ? (const TlvPatch *) (m_data + m_patchOffset) : NULL;
+}
+
+const TlvTag * QCATlvIndex::findTag(u16 id) const
+{
+    if (id < TLV_TAG_MAP_SIZE)
+    {
+        return m_tagMap[id] ? &m_tags[m_tagMap[id] - 1] : NULL;
+    }
+
+    for (u32 i = 0; i < m_tagCount; ++i)
+    {
+        if (m_tags[i].id == id)
+        {
+            return &m_tags[i];
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,76 @@
+//
+//  QCATlvIndex.hpp
+//  QCABluetoothFirmware
+//
+//  Copyright © 2021 cjiang. All rights reserved.
+//
+
+#ifndef QCATlvIndex_hpp
+#define QCATlvIndex_hpp
+
+#include "QCABluetoothFirmware.hpp"
+
+#define TLV_HDR_SIZE                    sizeof( TlvHdr )
+#define TLV_NVM_TAG_HDR_SIZE            sizeof( TlvNvm )
+
+#define TLV_MAX_RECORDS                 8
+#define TLV_MAX_TAGS                    64
+#define TLV_TAG_MAP_SIZE                256     /* tag ids below this are looked up directly */
+
+#define TLV_GET_TYPE(type_len)          ((type_len) & 0x000000ff)
+#define TLV_GET_LENGTH(type_len)        (((type_len) >> 8) & 0x00ffffff)
+
+struct TlvRecord
+{
+    u8          type;
+    u32         offset;         /* of the record payload in the blob */
+    u32         length;         /* of the record payload */
+};
+
+struct TlvTag
+{
+    u16         id;
+    u16         len;
+    u32         offset;         /* of the tag data in the blob */
+};
+
+/* Index over a TLV blob, built in one bounds-checked pass.
+ *
+ * Records every TLV record (descending into multi-TLV containers), the
+ * patch header, and every NVM tag, so that later lookups do not have to
+ * walk the blob again. Offsets are relative to the start of the blob.
+ */
+class QCATlvIndex
+{
+public:
+    void                reset();
+    bool                parse(const u8 * data, u32 size);
+
+    u32                 getRecordCount() const          { return m_recordCount; }
+    const TlvRecord *   getRecord(u32 i) const          { return i < m_recordCount ? &m_records[i] : NULL; }
+    const TlvRecord *   findRecord(u8 type) const;
+
+    const TlvPatch  *   getPatchHeader() const;
+
+    u32                 getTagCount() const             { return m_tagCount; }
+    const TlvTag    *   getTag(u32 i) const             { return i < m_tagCount ? &m_tags[i] : NULL; }
+    const TlvTag    *   findTag(u16 id) const;
+
+private:
+    bool                parseRecords(u32 offset, u32 end, bool nested);
+    bool                parseNvmTags(u32 offset, u32 length);
+
+    const u8        *   m_data;
+    u32                 m_size;
+
+    TlvRecord           m_records[TLV_MAX_RECORDS];
+    u32                 m_recordCount;
+
+    TlvTag              m_tags[TLV_MAX_TAGS];
+    u32                 m_tagCount;
+    u8                  m_tagMap[TLV_TAG_MAP_SIZE];     /* tag slot + 1, 0 if absent */
+
+    u32                 m_patchOffset;                  /* 0 if there is no patch record */
+};
+
+#endif /* QCATlvIndex_hpp */
@@ -0,0 +1,77 @@
+//
+//  QCATlvOverlay.cpp
+//  QCABluetoothFirmware
+//
+//  Copyright © 2021 cjiang. All rights reserved.
+//
+
+#include "QCATlvOverlay.hpp"
+
+bool QCATlvOverlay::set(u32 offset, const void * data, u8 len)
+{
+    if (!len || len > TLV_OVERLAY_MAX_PATCH_LEN)
+    {
+        return false;
+    }
+
+    /* Later patches to the same place replace earlier ones */
+    for (u32 i = 0; i < m_count; ++i)
+    {
+        if (m_patches[i].offset == offset && m_patches[i].len == len)
+        {
+            memcpy(m_patches[i].data, data, len);
+            return true;
+        }
+    }
+
+    if (m_count == TLV_OVERLAY_MAX_PATCHES)
+    {
+        ErrorLog("(set) Too many overlay patches!!!\n");
+        return false;
+    }
+
+    m_patches[m_count].offset = offset;
+    m_patches[m_count].len = len;
+    memcpy(m_patches[m_count].data, data, len);
+    ++m_count;
+
+    return true;
+}
+
+u8 QCATlvOverlay::getByte(const u8 * blob, u32 offset) const
+{
+    u8 value = blob[offset];
+
+    apply(offset, &value, 1);
+
+    return value;
+}
+
+bool QCATlvOverlay::overlaps(u32 offset, u32 len) const
+{
+    for (u32 i = 0; i < m_count; ++i)
+    {
+        if (m_patches[i].offset < offset + len && offset < m_patches[i].offset + m_patches[i].len)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+void QCATlvOverlay::apply(u32 offset, u8 * dst, u32 len) const
+{
+    u32 start, end;
+
+    /* Patches are applied in the order they were set */
+    for (u32 i = 0; i < m_count; ++i)
+    {
+        start = max(m_patches[i].offset, offset);
+        end = min(m_patches[i].offset + m_patches[i].len, offset + len);
+
+        if (start < end)
+        {
+            memcpy(dst + (start - offset), m_patches[i].data + (start - m_patches[i].offset), end - start);
+        }
+    }
+}
@@ -0,0 +1,52 @@
+//
+//  QCATlvOverlay.hpp
+//  QCABluetoothFirmware
+//
+//  Copyright © 2021 cjiang. All rights reserved.
+//
+
+#ifndef QCATlvOverlay_hpp
+#define QCATlvOverlay_hpp
+
+#include "QCABluetoothFirmware.hpp"
+
+#define TLV_OVERLAY_MAX_PATCHES         16
+#define TLV_OVERLAY_MAX_PATCH_LEN       16
+
+/* Patch lengths are kept in a u8 */
+static_assert(TLV_OVERLAY_MAX_PATCH_LEN <= 255, "TLV_OVERLAY_MAX_PATCH_LEN does not fit a u8");
+
+struct TlvOverlayPatch
+{
+    u32         offset;         /* in the blob */
+    u8          len;
+    u8          data[TLV_OVERLAY_MAX_PATCH_LEN];
+};
+
+/* Sparse list of byte patches over a read-only blob.
+ *
+ * Instead of writing NVM tag changes into a private copy of the whole
+ * file, the changes are recorded here and applied to each segment as it
+ * is copied out to the controller.
+ */
+class QCATlvOverlay
+{
+public:
+    void                reset()                         { m_count = 0; }
+    u32                 getCount() const                { return m_count; }
+
+    bool                set(u32 offset, const void * data, u8 len);
+    bool                setByte(u32 offset, u8 value)   { return set(offset, &value, 1); }
+
+    /* Reads the byte at offset as it will be sent */
+    u8                  getByte(const u8 * blob, u32 offset) const;
+
+    bool                overlaps(u32 offset, u32 len) const;
+    void                apply(u32 offset, u8 * dst, u32 len) const;
+
+private:
+    TlvOverlayPatch     m_patches[TLV_OVERLAY_MAX_PATCHES];
+    u32                 m_count;
+};
+
+#endif /* QCATlvOverlay_hpp */
@@ -0,0 +1,310 @@
+//
+//  QCAUartTransport.cpp
+//  QCABluetoothFirmware
+//
+//  Copyright © 2021 cjiang. All rights reserved.
+//
+
+#include "QCAUartTransport.hpp"
+
+QCAUartTransport::QCAUartTransport(IOSerialStreamSync * stream, OSObject * owner, HciEventAction action) : QCATransport(owner, action)
+{
+    m_pStream = stream;
+    m_speed = 0;
+
+    m_pLock = IOLockAlloc();
+    m_readerRunning = false;
+    m_reading = false;
+
+    m_rxType = 0;
+    m_rxHdrLen = 0;
+    m_rxLen = 0;
+    m_rxNeed = 0;
+}
+
+QCAUartTransport::~QCAUartTransport()
+{
+    close();
+
+    if (m_pLock)
+    {
+        IOLockFree(m_pLock);
+        m_pLock = NULL;
+    }
+}
+
+bool QCAUartTransport::open(u32 speed)
+{
+    thread_t thread;
+
+    if (!m_pStream || !m_pLock)
+    {
+        return false;
+    }
+
+    if (m_pStream->acquirePort(false))
+    {
+        ErrorLog("(open) Failed to acquire serial port!!!\n");
+        return false;
+    }
+
+    /* 8N1 with RTS/CTS, rates and sizes are in half bits */
+    m_pStream->executeEvent(PD_E_DATA_SIZE, 8 << 1);
+    m_pStream->executeEvent(PD_RS232_E_STOP_BITS, 1 << 1);
+    m_pStream->executeEvent(PD_E_DATA_INTEGRITY, PD_RS232_PARITY_NONE);
+    m_pStream->executeEvent(PD_RS232_E_FLOW_CONTROL, PD_RS232_A_RFR | PD_RS232_A_CTS);
+
+    if (setSpeed(speed) || m_pStream->executeEvent(PD_E_ACTIVE, true))
+    {
+        ErrorLog("(open) Failed to configure serial port!!!\n");
+        m_pStream->releasePort();
+        return false;
+    }
+
+    m_rxType = 0;
+    m_reading = true;
+    m_readerRunning = true;
+
+    if (kernel_thread_start(readThread, this, &thread) != KERN_SUCCESS)
+    {
+        ErrorLog("(open) Failed to start read thread!!!\n");
+        m_reading = false;
+        m_readerRunning = false;
+        m_pStream->executeEvent(PD_E_ACTIVE, false);
+        m_pStream->releasePort();
+        return false;
+    }
+
+    thread_deallocate(thread);
+
+    return true;
+}
+
+void QCAUartTransport::close()
+{
+    if (!m_reading)
+    {
+        return;
+    }
+
+    IOLockLock(m_pLock);
+    m_reading = false;
+    IOLockUnlock(m_pLock);
+
+    /* Deactivating the port fails the blocked read */
+    m_pStream->executeEvent(PD_E_ACTIVE, false);
+
+    IOLockLock(m_pLock);
+    while (m_readerRunning)
+    {
+        IOLockSleep(m_pLock, &m_readerRunning, THREAD_UNINT);
+    }
+    IOLockUnlock(m_pLock);
+
+    m_pStream->releasePort();
+}
+
+IOReturn QCAUartTransport::setSpeed(u32 speed)
+{
+    UInt32 state = PD_S_TXQ_EMPTY;
+    IOReturn ret;
+
+    /* Anything still queued would go out at the new speed */
+    if (m_speed)
+    {
+        m_pStream->watchState(&state, PD_S_TXQ_EMPTY);
+        IOSleep(QCA_UART_SPEED_SETTLE_TIME);
+    }
+
+    ret = m_pStream->executeEvent(PD_E_DATA_RATE, speed << 1);
+
+    if (ret)
+    {
+        ErrorLog("(setSpeed) Failed to set UART speed to %u (err: 0x%x)!!!\n", (unsigned int) speed, ret);
+        return ret;
+    }
+
+    DebugLog("(setSpeed) UART speed set to %u.\n", (unsigned int) speed);
+
+    m_speed = speed;
+    return kIOReturnSuccess;
+}
+
+/* An external circuit decodes the pulse from the TX line, so it has to go
+ * out at the speed it expects and without flow control holding it back.
+ */
+IOReturn QCAUartTransport::sendPowerPulse(u8 pulse, u32 speed)
+{
+    UInt32 state = PD_S_TXQ_EMPTY;
+    IOReturn ret;
+
+    if ((ret = setSpeed(speed)))
+    {
+        return ret;
+    }
+
+    m_pStream->executeEvent(PD_RS232_E_FLOW_CONTROL, 0);
+
+    ret = writeBytes(&pulse, 1);
+    m_pStream->watchState(&state, PD_S_TXQ_EMPTY);
+
+    m_pStream->executeEvent(PD_RS232_E_FLOW_CONTROL, PD_RS232_A_RFR | PD_RS232_A_CTS);
+
+    return ret;
+}
+
+IOReturn QCAUartTransport::sendCommand(const HciCommandHdr * cmd, UInt32 timeout)
+{
+    u8 type = H4_CMD_PKT;
+    IOReturn ret;
+
+    /* The stream queues the write, flow control paces it */
+    if ((ret = writeBytes(&type, 1)))
+    {
+        return ret;
+    }
+
+    return writeBytes((const u8 *) cmd, HCI_COMMAND_HDR_SIZE + cmd->plen);
+}
+
+IOReturn QCAUartTransport::writeBytes(const u8 * data, u32 len)
+{
+    UInt32 count;
+    IOReturn ret;
+
+    /* The port is released once closed */
+    if (!m_reading)
+    {
+        return kIOReturnNotOpen;
+    }
+
+    while (len)
+    {
+        if ((ret = m_pStream->enqueueData((UInt8 *) data, len, &count, true)))
+        {
+            ErrorLog("(writeBytes) Failed to write to serial port (err: 0x%x)!!!\n", ret);
+            return ret;
+        }
+        data += count;
+        len -= count;
+    }
+
+    return kIOReturnSuccess;
+}
+
+void QCAUartTransport::receiveBytes(const u8 * data, u32 len)
+{
+    u8 c;
+
+    while (len--)
+    {
+        c = *data++;
+
+        if (!m_rxType)
+        {
+            switch (c)
+            {
+                case H4_EVT_PKT:
+                    m_rxHdrLen = HCI_EVENT_HDR_SIZE;
+                    break;
+                case H4_ACL_PKT:
+                    m_rxHdrLen = 4;
+                    break;
+                case H4_SCO_PKT:
+                    m_rxHdrLen = 3;
+                    break;
+                default:
+                    /* Out of sync, wait for the next packet type */
+                    if (!handleControlByte(c))
+                    {
+                        DebugLog("(receiveBytes) Skipping byte 0x%02x.\n", c);
+                    }
+                    continue;
+            }
+
+            m_rxType = c;
+            m_rxLen = 0;
+            m_rxNeed = m_rxHdrLen;
+            continue;
+        }
+
+        /* Only events are kept past their header, and only when they fit */
+        if (m_rxLen < sizeof(m_rxBuf) && (m_rxType == H4_EVT_PKT || m_rxLen < m_rxHdrLen) && m_rxNeed <= sizeof(m_rxBuf))
+        {
+            m_rxBuf[m_rxLen] = c;
+        }
+        ++m_rxLen;
+
+        if (m_rxLen < m_rxNeed)
+        {
+            continue;
+        }
+
+        if (m_rxNeed == m_rxHdrLen)
+        {
+            switch (m_rxType)
+            {
+                case H4_EVT_PKT:
+                    m_rxNeed += m_rxBuf[1];
+                    break;
+                case H4_ACL_PKT:
+                    m_rxNeed += get_unaligned_le16(m_rxBuf + 2);
+                    break;
+                default:
+                    m_rxNeed += m_rxBuf[2];
+                    break;
+            }
+
+            /* Its bytes are still counted off to stay in sync, nothing more */
+            if (m_rxNeed > sizeof(m_rxBuf))
+            {
+                DebugLog("(receiveBytes) Dropping packet 0x%02x of %u bytes.\n", m_rxType, (unsigned int) m_rxNeed);
+            }
+
+            if (m_rxLen < m_rxNeed)
+            {
+                continue;
+            }
+        }
+
+        if (m_rxType == H4_EVT_PKT && m_rxLen <= sizeof(m_rxBuf))
+        {
+            deliverEvent(m_rxBuf, (u16) m_rxLen);
+        }
+
+        m_rxType = 0;
+    }
+}
+
+void QCAUartTransport::readThread(void * arg, wait_result_t result)
+{
+    QCAUartTransport * that = (QCAUartTransport *) arg;
+    u8 buf[QCA_UART_READ_CHUNK];
+    UInt32 count;
+    IOReturn ret;
+
+    while (that->m_reading)
+    {
+        ret = that->m_pStream->dequeueData(buf, sizeof(buf), &count, 1);
+
+        if (ret)
+        {
+            /* Port went offline (closing or unplugged) */
+            break;
+        }
+
+        if (count)
+        {
+            that->receiveBytes(buf, count);
+        }
+    }
+
+    DebugLog("(readThread) Stopped reading events.\n");
+
+    IOLockLock(that->m_pLock);
+    that->m_readerRunning = false;
+    IOLockWakeup(that->m_pLock, &that->m_readerRunning, false);
+    IOLockUnlock(that->m_pLock);
+
+    thread_terminate(current_thread());
+}
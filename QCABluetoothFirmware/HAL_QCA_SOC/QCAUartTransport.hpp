@@ -0,0 +1,69 @@
+//
+//  QCAUartTransport.hpp
+//  QCABluetoothFirmware
+//
+//  Copyright © 2021 cjiang. All rights reserved.
+//
+
+#ifndef QCAUartTransport_hpp
+#define QCAUartTransport_hpp
+
+#include "QCABluetoothFirmware.hpp"
+#include <IOKit/serial/IORS232SerialStreamSync.h>
+
+#define H4_CMD_PKT                      0x01
+#define H4_ACL_PKT                      0x02
+#define H4_SCO_PKT                      0x03
+#define H4_EVT_PKT                      0x04
+
+#define QCA_UART_INIT_SPEED             115200
+#define QCA_UART_READ_CHUNK             64
+#define QCA_UART_SPEED_SETTLE_TIME      10      /* ms after the last byte went out */
+
+/* H4 over a serial stream: each packet is prefixed with its type.
+ *
+ * Events are read on a kernel thread of our own, since the serial stream
+ * only offers blocking reads. Everything else received is skipped.
+ */
+class QCAUartTransport : public QCATransport
+{
+public:
+    QCAUartTransport(IOSerialStreamSync * stream, OSObject * owner, HciEventAction action);
+    virtual ~QCAUartTransport();
+
+    virtual const char  *   getName() const override    { return "H4"; }
+
+    virtual bool            open(u32 speed) override;
+    virtual void            close() override;
+
+    virtual IOReturn        sendCommand(const HciCommandHdr * cmd, UInt32 timeout) override;
+
+    virtual IOReturn        setSpeed(u32 speed) override;
+    virtual u32             getSpeed() const override   { return m_speed; }
+
+    virtual IOReturn        sendPowerPulse(u8 pulse, u32 speed) override;
+
+protected:
+    IOReturn                writeBytes(const u8 * data, u32 len);
+    virtual void            receiveBytes(const u8 * data, u32 len);
+    virtual bool            handleControlByte(u8 c)     { return false; }
+
+    IOSerialStreamSync  *   m_pStream;
+    u32                     m_speed;
+    IOLock              *   m_pLock;
+
+private:
+    static void             readThread(void * arg, wait_result_t result);
+
+    bool                    m_reading;
+    bool                    m_readerRunning;
+
+    /* Packet being reassembled, type byte excluded */
+    u8                      m_rxType;
+    u8                      m_rxHdrLen;
+    u32                     m_rxLen;
+    u32                     m_rxNeed;           /* header plus its length field, up to 0x10003 */
+    u8                      m_rxBuf[HCI_MAX_EVENT_SIZE];
+};
+
+#endif /* QCAUartTransport_hpp */
@@ -24,6 +24,7 @@
 */
 
 #include "QCABluetoothFirmware.hpp"
+#include "QCABringUpScheduler.hpp"
 
 #define super IOService
 
@@ -42,6 +43,16 @@ IOService * QCABluetoothFirmware::probe(IOService * provider, SInt32 * score)
     m_pUSBDevice = OSDynamicCast(IOUSBHostDevice, provider);
     if (!m_pUSBDevice)
     {
+        /* UART attached SoC's have no ID to look up, the personality names the type */
+        OSNumber * socType = OSDynamicCast(OSNumber, getProperty("QCASoCType"));
+        
+        if (OSDynamicCast(IOSerialStreamSync, provider) && socType)
+        {
+            m_socType = socType->unsigned32BitValue();
+            InfoLog("(probe) Serial SoC type = %d\n", m_socType);
+            return this;
+        }
+        
         ErrorLog("(probe) Provider is not a USB device!!!\n");
         return NULL;
     }
@@ -73,6 +84,7 @@ void QCABluetoothFirmware::stop(IOService * provider)
 {
     FuncLog("stop");
     
+    waitBringUp(true);
     releaseAll();
     PMstop();
     
@@ -112,6 +124,26 @@ bool QCABluetoothFirmware::init(OSDictionary * propTable)
     m_pUSBDevice        = NULL;
     m_pBulkWritePipe    = NULL;
     m_pBulkWritePipe    = NULL;
+    m_pInterruptReadPipe = NULL;
+    m_pTransport        = NULL;
+    
+    m_pWorkLoop         = NULL;
+    m_pCommandGate      = NULL;
+    
+    m_bringUpCall       = NULL;
+    m_bringUpLock       = NULL;
+    m_bringUpRunning    = false;
+    m_bringUpAbort      = false;
+    m_bringUpAckPower   = false;
+    m_bringUpState      = QCA_BRINGUP_IDLE;
+    m_queueDelay        = 0;
+    
+    m_pInterruptReadBuffer = NULL;
+    m_eventHead = 0;
+    m_eventTail = 0;
+    m_hciEvent = NULL;
+    m_hciEventData = NULL;
+    m_hciEventLen = 0;
     
     m_fwState = NULL;
     m_fwVersion = NULL;
@@ -123,13 +155,19 @@ bool QCABluetoothFirmware::init(OSDictionary * propTable)
     m_socVersion = NULL;
         
     m_fwData = NULL;
-    m_hciCommand = NULL;
+    m_hciCommand = new HciCommandHdr;
     m_fwFilename = "";
     
     m_tlvType = TLV_TYPE_INVALID;
     m_bdRate  = QCA_BAUDRATE_115200;
     m_dnldMode = QCA_SKIP_EVT_NONE;
     
+    if (!m_hciCommand)
+    {
+        ErrorLog("(init) Failed to allocate HCI command buffer!!!\n");
+        return false;
+    }
+    
     return super::init(propTable);
 }
 
@@ -140,6 +178,19 @@ void QCABluetoothFirmware::free()
     PMstop();
     releaseAll();
     
+    /* The call holds a reference while it runs, so it is idle by now */
+    if (m_bringUpCall)
+    {
+        thread_call_free(m_bringUpCall);
+        m_bringUpCall = NULL;
+    }
+    
+    if (m_bringUpLock)
+    {
+        IOLockFree(m_bringUpLock);
+        m_bringUpLock = NULL;
+    }
+    
     super::free();
 }
 
@@ -238,15 +289,25 @@ void QCABluetoothFirmware::releaseAll()
         OSSafeReleaseNULL(m_pBulkWritePipe);
     }
     
+    if (m_pTransport)
+    {
+        m_pTransport->close();
+        safe_delete(m_pTransport);
+    }
+    
+    releaseCommandGate();
+    
     safe_delete(m_fwState);
     
     safe_delete(m_fwVersion);
     
     safe_delete(m_devStatus);
     
-    safe_delete(m_rpVersion);
+    /* Points into the ram patch */
+    m_rpVersion = NULL;
     
-    safe_delete(m_devInfo);
+    /* Points into the static device table */
+    m_devInfo = NULL;
     
     safe_delete(m_socVersion);
     
@@ -255,7 +316,7 @@ void QCABluetoothFirmware::releaseAll()
     OSSafeReleaseNULL(m_fwData);
 }
 
-IOReturn QCABluetoothFirmware::sendVendorRequestIn(u8 bRequest, void * dataBuffer, UInt16 size)
+IOReturn QCABluetoothFirmware::sendVendorRequestIn(u8 bRequest, void * dataBuffer, UInt16 size, UInt32 timeout)
 {
     UInt32 bytesTransferred;
     
@@ -268,10 +329,10 @@ IOReturn QCABluetoothFirmware::sendVendorRequestIn(u8 bRequest, void * dataBuffe
         .wLength = size
     };
     
-    return  m_pUSBDevice->deviceRequest( this, request, dataBuffer, bytesTransferred, kUSBHostStandardRequestCompletionTimeout );
+    return  m_pUSBDevice->deviceRequest( this, request, dataBuffer, bytesTransferred, timeout );
 }
 
-IOReturn QCABluetoothFirmware::sendVendorRequestOut(u8 bRequest, void * dataBuffer, UInt16 size)
+IOReturn QCABluetoothFirmware::sendVendorRequestOut(u8 bRequest, void * dataBuffer, UInt16 size, UInt32 timeout)
 {
     UInt32 bytesTransferred;
     
@@ -284,12 +345,44 @@ IOReturn QCABluetoothFirmware::sendVendorRequestOut(u8 bRequest, void * dataBuff
         .wLength = size
     };
     
-    return  m_pUSBDevice->deviceRequest( this, request, dataBuffer, bytesTransferred, kUSBHostStandardRequestCompletionTimeout );
+    return  m_pUSBDevice->deviceRequest( this, request, dataBuffer, bytesTransferred, timeout );
 }
 
-IOReturn QCABluetoothFirmware::sendHCIRequest(uint16_t opCode, uint8_t paramLen, const void * param)
+IOReturn QCABluetoothFirmware::sendHCIRequest(uint16_t opCode, uint8_t paramLen, const void * param, uint8_t event, UInt32 timeout)
 {
     FuncLog("sendHCIRequest");
+    
+    IOReturn ret;
+    UInt64 deadline;
+    
+    /* Nothing to wait on: either the caller does not expect a reply, or
+     * nothing is reading events (e.g. while tearing down).
+     */
+    if (!timeout || !m_pCommandGate || !hasEventSource())
+    {
+        return submitHCIRequest(opCode, paramLen, param, timeout ? timeout : kUSBHostStandardRequestCompletionTimeout);
+    }
+    
+    /* Drop whatever is left over from earlier commands, so that only a
+     * reply to this one can complete the wait below.
+     */
+    m_pCommandGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &QCABluetoothFirmware::flushEventsGated));
+    
+    /* Sending and waiting share the timeout, a hung controller costs it once */
+    clock_interval_to_deadline(timeout, kMillisecondScale, &deadline);
+    
+    ret = submitHCIRequest(opCode, paramLen, param, timeout);
+    
+    if (ret)
+    {
+        return ret;
+    }
+    
+    return waitHCIReplyUntil(opCode, event, deadline);
+}
+
+IOReturn QCABluetoothFirmware::submitHCIRequest(uint16_t opCode, uint8_t paramLen, const void * param, UInt32 timeout)
+{
     InfoLog("opCode:        0x%02x\n",  opCode);
     InfoLog("paramLen:      %d\n",      paramLen);
     
@@ -303,14 +396,78 @@ IOReturn QCABluetoothFirmware::sendHCIRequest(uint16_t opCode, uint8_t paramLen,
     };
     
     UInt32 bytesTransfered;
+    IOReturn ret;
+    
+    /* Gone once releaseAll has run */
+    if (!m_hciCommand)
+    {
+        return kIOReturnNotReady;
+    }
     
-    bzero(m_hciCommand, sizeof( HciCommandHdr ));
     m_hciCommand->opcode = opCode;
     m_hciCommand->plen = paramLen;
     
-    memcpy((void *) m_hciCommand->pData, param, paramLen);
+    /* Callers may have assembled the parameters in place already */
+    if (param != m_hciCommand->pData)
+    {
+        memcpy((void *) m_hciCommand->pData, param, paramLen);
+    }
     
-    return m_pInterface->deviceRequest(request, (void *) m_hciCommand, bytesTransfered);
+    m_hciEvent = NULL;
+    m_hciEventData = NULL;
+    m_hciEventLen = 0;
+    
+    if (m_pTransport)
+    {
+        ret = m_pTransport->sendCommand(m_hciCommand, timeout);
+    }
+    else if (m_pInterface)
+    {
+        ret = m_pInterface->deviceRequest(request, (void *) m_hciCommand, bytesTransfered, timeout);
+    }
+    else
+    {
+        ret = kIOReturnNotOpen;
+    }
+    
+    if (ret)
+    {
+        ErrorLog("(submitHCIRequest) Failed to send command 0x%04x (err: 0x%x)!!!\n", opCode, ret);
+    }
+    
+    return ret;
+}
+
+IOReturn QCABluetoothFirmware::waitHCIReply(uint16_t opCode, uint8_t event, UInt32 timeout)
+{
+    UInt64 deadline;
+    
+    clock_interval_to_deadline(timeout, kMillisecondScale, &deadline);
+    
+    return waitHCIReplyUntil(opCode, event, deadline);
+}
+
+/* The deadline is fixed by the caller, so that the time spent sending the
+ * command and unrelated events arriving in the meantime do not extend the
+ * wait beyond the requested timeout.
+ */
+IOReturn QCABluetoothFirmware::waitHCIReplyUntil(uint16_t opCode, uint8_t event, UInt64 deadline)
+{
+    IOReturn ret;
+    
+    if (!m_pCommandGate || !hasEventSource())
+    {
+        return kIOReturnNotReady;
+    }
+    
+    ret = m_pCommandGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &QCABluetoothFirmware::waitForHCIEventGated), (void *)(uintptr_t) opCode, (void *)(uintptr_t) event, (void *)(uintptr_t) deadline);
+    
+    if (ret == kIOReturnTimeout)
+    {
+        ErrorLog("(waitHCIReply) No response to command 0x%04x in time!!!\n", opCode);
+    }
+    
+    return ret;
 }
 
 bool QCABluetoothFirmware::resetDevice()
@@ -469,6 +626,23 @@ bool QCABluetoothFirmware::initInterface()
             m_pBulkWritePipe->retain();
             m_pBulkWritePipe->release();
         }
+        else if (epDir == kUSBIn && epType == kUSBInterrupt)
+        {
+            DebugLog("(initInterface) Found interrupt-in endpoint.\n");
+            
+            m_pInterruptReadPipe = m_pInterface->copyPipe(StandardUSB::getEndpointAddress(endpointDescriptor));
+            
+            if (!m_pInterruptReadPipe)
+            {
+                ErrorLog("(initInterface) Failed to copy InterruptReadPipe!!!\n");
+                
+                return false;
+            }
+        }
+        else if (epDir == kUSBIn && epType == kUSBBulk)
+        {
+            DebugLog("(initInterface) Skipping bulk-in endpoint.\n");
+        }
         else
         {
             ErrorLog("(initInterface) Endpoint invalid!!!\n");
@@ -484,84 +658,650 @@ bool QCABluetoothFirmware::initInterface()
 
 bool QCABluetoothFirmware::loadFirmware(OSData * fwData, size_t headerSize)
 {
-    u8 * sendBuf = (u8 *) fwData->getBytesNoCopy();
+    QCAFirmwareImage image;
+    bool ret;
+    
+    if (!prepareFirmware(fwData, headerSize, &image))
+    {
+        return false;
+    }
+    
+    ret = loadFirmware(&image);
+    
+    releaseFirmware(&image);
+    return ret;
+}
+
+/* Everything that does not need the device, so it can be done ahead of time.
+ * The image keeps its own reference to fwData.
+ */
+bool QCABluetoothFirmware::prepareFirmware(OSData * fwData, size_t headerSize, QCAFirmwareImage * image)
+{
+    bzero(image, sizeof(QCAFirmwareImage));
+    
+    if (!fwData || !fwData->getBytesNoCopy() || fwData->getLength() <= headerSize)
+    {
+        ErrorLog("(prepareFirmware) Firmware is shorter than its header!!!\n");
+        
+        return false;
+    }
+    
+    image->bounce = IOBufferMemoryDescriptor::inTaskWithOptions(kernel_task, kIODirectionOut, BULK_SIZE);
+    
+    if (!image->bounce)
+    {
+        ErrorLog("(prepareFirmware) Unable to allocate memory chunk for firmware!!!\n");
+        
+        return false;
+    }
+    
+    if (image->bounce->prepare())
+    {
+        ErrorLog("(prepareFirmware) Failed to prepare memory descriptor!!!\n");
+        
+        OSSafeReleaseNULL(image->bounce);
+        
+        return false;
+    }
+    
+    fwData->retain();
+    image->data = fwData;
+    image->headerSize = headerSize;
+    
+    return true;
+}
+
+void QCABluetoothFirmware::releaseFirmware(QCAFirmwareImage * image)
+{
+    if (image->bounce)
+    {
+        image->bounce->complete();
+        OSSafeReleaseNULL(image->bounce);
+    }
+    
+    OSSafeReleaseNULL(image->data);
+}
+
+bool QCABluetoothFirmware::loadFirmware(const QCAFirmwareImage * image)
+{
+    int ticket;
+    bool ret;
     
-    if (!sendBuf)
+    if (!scheduleDownload((u32) image->data->getLength(), &ticket))
     {
-        ErrorLog("(loadFirmware) Unable to allocate memory chunk for firmware!!!\n");
+        return false;
+    }
+    
+    ret = sendFirmware(image);
+    
+    finishDownload(ticket);
+    return ret;
+}
+
+/* Waits for room on the device's hub, see QCABringUpScheduler. False when
+ * the bring-up was stopped while waiting, nothing may be sent then.
+ */
+bool QCABluetoothFirmware::scheduleDownload(u32 bytes, int * ticket)
+{
+    u64 delay;
+    
+    * ticket = QCABringUpScheduler::acquireDownload(m_pUSBDevice, bytes, &m_bringUpAbort, &delay);
+    
+    if (* ticket < 0 && m_bringUpAbort)
+    {
+        WarningLog("(scheduleDownload) Stopped while waiting for the hub!\n");
+        return false;
+    }
+    
+    if (delay)
+    {
+        InfoLog("(scheduleDownload) Waited %llu ms for %u bytes behind the same hub.\n", delay, (unsigned int) bytes);
+    }
+    
+    m_queueDelay += delay;
+    setProperty(QCA_FW_QUEUE_DELAY_PROPERTY, m_queueDelay, 64);
+    
+    return true;
+}
+
+void QCABluetoothFirmware::finishDownload(int ticket)
+{
+    QCABringUpScheduler::releaseDownload(ticket);
+}
+
+bool QCABluetoothFirmware::sendFirmware(const QCAFirmwareImage * image)
+{
+    const u8 * sendBuf = (const u8 *) image->data->getBytesNoCopy();
+    
+    if (!m_pBulkWritePipe)
+    {
+        ErrorLog("(loadFirmware) No bulk pipe to load firmware to!!!\n");
         
         return false;
     }
     
-    if (sendVendorRequestOut(QCA_DOWNLOAD, (void *) fwData->getBytesNoCopy(), headerSize))
+    if (sendVendorRequestOut(QCA_DOWNLOAD, (void *) sendBuf, image->headerSize, QCA_DFU_TIMEOUT))
     {
         ErrorLog("(loadFirmware) Failed to download firmware!!!\n");
         
         return false;
     }
     
-    unsigned long size = fwData->getLength() - headerSize; /* size of the firmware */
-    sendBuf += headerSize;
+    unsigned long size = image->data->getLength() - image->headerSize; /* size of the firmware */
+    sendBuf += image->headerSize;
     
     int i = 1; /* Indicator of current bulk pipe block */
     u32 toSend; /* Size to send in each block */
+    u32 bytesTransferred;
     
     while (size)
     {
-        toSend = (size < BULK_SIZE) ? size : BULK_SIZE; /* <= is also OK, but I presume that calling a macro is faster than calling an int. */
+        toSend = (size < BULK_SIZE) ? (u32) size : BULK_SIZE;
         
-        char * tempBuf = new char [size];
-        IOMemoryDescriptor * memBuf = IOMemoryDescriptor::withAddress(& tempBuf, BULK_SIZE, kIODirectionOut);
-        
-        if (!memBuf)
+        memcpy(image->bounce->getBytesNoCopy(), sendBuf, toSend);
+
+        int ret = m_pBulkWritePipe->io(image->bounce, toSend, bytesTransferred, QCA_DFU_TIMEOUT);
+        if (ret)
         {
-            ErrorLog("(loadFirmware) Failed to map memory descriptor!!!\n");
-            
-            safe_delete_arr(tempBuf);
+            ErrorLog("(loadFirmware) Failed writing firmware to bulk pipe (err: %d, block: %d, to_send: %u)!!!\n", ret, i, (unsigned int) toSend);
             
             return false;
         }
         
-        if (memBuf->prepare())
+        DebugLog("(loadFirmware) Loaded firmware to bulk pipe block %d.\n", i);
+        
+        sendBuf += toSend;
+        size    -= toSend;
+        
+        ++i; /* Going to the next block... */
+    }
+    
+    DebugLog("(loadFirmware) Successfully loaded firmware.\n");
+    
+    return true;
+}
+
+/* Returns right away, the outcome comes through setBringUpState. With
+ * ackPowerState the bring-up finishes a power state change, whoever
+ * started it returned a settle time and the end acknowledges it.
+ */
+bool QCABluetoothFirmware::startBringUp(bool ackPowerState)
+{
+    if (!m_bringUpLock)
+    {
+        m_bringUpLock = IOLockAlloc();
+    }
+    
+    if (!m_bringUpCall)
+    {
+        m_bringUpCall = thread_call_allocate(bringUpCall, this);
+    }
+    
+    if (!m_bringUpLock || !m_bringUpCall)
+    {
+        ErrorLog("(startBringUp) Failed to allocate bring-up thread call!!!\n");
+        
+        return false;
+    }
+    
+    m_bringUpRunning = true;
+    m_bringUpAbort = false;
+    m_bringUpAckPower = ackPowerState;
+    
+    setBringUpState(QCA_BRINGUP_QUEUED);
+    
+    /* Dropped by bringUpCall */
+    retain();
+    thread_call_enter(m_bringUpCall);
+    
+    return true;
+}
+
+/* With abort set, a bring-up still waiting for a slot gives up */
+void QCABluetoothFirmware::waitBringUp(bool abort)
+{
+    if (!m_bringUpLock)
+    {
+        return;
+    }
+    
+    IOLockLock(m_bringUpLock);
+    
+    if (abort)
+    {
+        m_bringUpAbort = true;
+        QCABringUpScheduler::wakeAll();
+    }
+    
+    while (m_bringUpRunning)
+    {
+        IOLockSleep(m_bringUpLock, &m_bringUpRunning, THREAD_UNINT);
+    }
+    
+    IOLockUnlock(m_bringUpLock);
+}
+
+void QCABluetoothFirmware::bringUpCall(thread_call_param_t param0, thread_call_param_t param1)
+{
+    QCABluetoothFirmware * that = (QCABluetoothFirmware *) param0;
+    OSNumber * limit = OSDynamicCast(OSNumber, that->getProperty("MaxConcurrentBringUps"));
+    QCABringUpState state = QCA_BRINGUP_FAILED;
+    bool ackPower = that->m_bringUpAckPower;
+    
+    /* Stopped while queued, nobody is left to tell */
+    if (!QCABringUpScheduler::acquire(limit ? limit->unsigned32BitValue() : QCA_MAX_CONCURRENT_BRINGUPS, &that->m_bringUpAbort))
+    {
+        state = QCA_BRINGUP_IDLE;
+    }
+    else
+    {
+        that->setBringUpState(QCA_BRINGUP_LOADING);
+        
+        if (that->bringUpDevice())
         {
-            ErrorLog("(loadFirmware) Failed to prepare memory descriptor!!!\n");
-            
-            OSSafeReleaseNULL(memBuf);
-            safe_delete_arr(tempBuf);
-            
-            return false;
+            state = that->getLoadedState();
         }
         
-        DebugLog("(loadFirmware) Memory descriptor successfully prepared.\n");
+        QCABringUpScheduler::release();
+    }
+    
+    that->setBringUpState(state);
+    
+    IOLockLock(that->m_bringUpLock);
+    
+    that->m_bringUpRunning = false;
+    IOLockWakeup(that->m_bringUpLock, &that->m_bringUpRunning, false);
+    
+    IOLockUnlock(that->m_bringUpLock);
+    
+    /* Also when aborted, power management waits for it either way */
+    if (ackPower)
+    {
+        that->acknowledgeSetPowerState();
+    }
+    
+    that->release();
+}
+
+/* Ready registers the driver, so clients can match on it only once the
+ * firmware runs. Both outcomes are also sent to clients already attached,
+ * Ready again after every wake. Switched tells nobody: the device is on
+ * its way out, see Ath3KReenumTracker.
+ */
+void QCABluetoothFirmware::setBringUpState(QCABringUpState state)
+{
+    static const char * names[] = { "Idle", "Queued", "Loading", "Ready", "Failed", "Switched" };
+    
+    DebugLog("(setBringUpState) Firmware state: %s.\n", names[state]);
+    
+    m_bringUpState = state;
+    setProperty(QCA_FW_STATE_PROPERTY, names[state]);
+    
+    switch (state)
+    {
+        case QCA_BRINGUP_READY:
+        {
+            if (!(getState() & kIOServiceRegisteredState))
+            {
+                registerService();
+            }
+            messageClients(kQCAMessageFirmwareReady);
+            break;
+        }
+        case QCA_BRINGUP_FAILED:
+        {
+            ErrorLog("(setBringUpState) Firmware bring-up failed!!!\n");
+            messageClients(kQCAMessageFirmwareFailed);
+            break;
+        }
+        default:
+        {
+            break;
+        }
+    }
+}
+
+bool QCABluetoothFirmware::initCommandGate()
+{
+    if (!hasEventSource())
+    {
+        ErrorLog("(initCommandGate) Nothing to read events from!!!\n");
         
-        memcpy(tempBuf, sendBuf, toSend);
+        return false;
+    }
+    
+    m_pWorkLoop = IOWorkLoop::workLoop();
+    
+    if (!m_pWorkLoop)
+    {
+        ErrorLog("(initCommandGate) Failed to create work loop!!!\n");
+        
+        return false;
+    }
+    
+    m_pCommandGate = IOCommandGate::commandGate(this);
+    
+    if (!m_pCommandGate || m_pWorkLoop->addEventSource(m_pCommandGate))
+    {
+        ErrorLog("(initCommandGate) Failed to create command gate!!!\n");
+        
+        OSSafeReleaseNULL(m_pCommandGate);
+        OSSafeReleaseNULL(m_pWorkLoop);
+        
+        return false;
+    }
+    
+    m_eventHead = m_eventTail = 0;
+    
+    m_eventDispatcher.reset();
+    m_eventDispatcher.subscribe(HCI_EV_HARDWARE_ERROR, this, hardwareErrorHandler);
+    
+    /* A transport delivers events through transportEventHandler instead */
+    if (!m_pInterruptReadPipe)
+    {
+        return true;
+    }
+    
+    m_pInterruptReadBuffer = IOBufferMemoryDescriptor::inTaskWithOptions(kernel_task, kIODirectionIn, HCI_MAX_EVENT_SIZE);
+    
+    if (!m_pInterruptReadBuffer || m_pInterruptReadBuffer->prepare())
+    {
+        ErrorLog("(initCommandGate) Failed to allocate interrupt read buffer!!!\n");
+        
+        releaseCommandGate();
+        
+        return false;
+    }
+    
+    m_interruptReadCompletion.owner = this;
+    m_interruptReadCompletion.action = interruptReadHandler;
+    m_interruptReadCompletion.parameter = NULL;
+    m_interruptReadErrors = 0;
+    
+    if (startInterruptRead())
+    {
+        ErrorLog("(initCommandGate) Failed to start reading events!!!\n");
+        
+        releaseCommandGate();
+        
+        return false;
+    }
+    
+    return true;
+}
 
-        int ret = m_pBulkWritePipe->io(memBuf, toSend, (IOUSBHostCompletion *) NULL, 0);
-        if (ret)
+void QCABluetoothFirmware::releaseCommandGate()
+{
+    if (m_pInterruptReadPipe)
+    {
+        m_pInterruptReadPipe->abort();
+        OSSafeReleaseNULL(m_pInterruptReadPipe);
+    }
+    
+    if (m_pInterruptReadBuffer)
+    {
+        m_pInterruptReadBuffer->complete();
+        OSSafeReleaseNULL(m_pInterruptReadBuffer);
+    }
+    
+    m_eventDispatcher.reset();
+    
+    if (m_pCommandGate)
+    {
+        m_pCommandGate->commandWakeup(m_eventRing);
+        
+        if (m_pWorkLoop)
         {
-            ErrorLog("(loadFirmware) Failed writing firmware to bulk pipe (err: %d, block: %d, to_send: %u)!!!\n", ret, i, (unsigned int) toSend);
+            m_pWorkLoop->removeEventSource(m_pCommandGate);
+        }
+        OSSafeReleaseNULL(m_pCommandGate);
+    }
+    
+    OSSafeReleaseNULL(m_pWorkLoop);
+    
+    m_hciEvent = NULL;
+    m_hciEventData = NULL;
+    m_hciEventLen = 0;
+}
+
+IOReturn QCABluetoothFirmware::startInterruptRead()
+{
+    return m_pInterruptReadPipe->io(m_pInterruptReadBuffer, (uint32_t) m_pInterruptReadBuffer->getLength(), &m_interruptReadCompletion, 0);
+}
+
+void QCABluetoothFirmware::interruptReadHandler(void * owner, void * parameter, IOReturn status, uint32_t bytesTransferred)
+{
+    QCABluetoothFirmware * that = (QCABluetoothFirmware *) owner;
+    
+    switch (status)
+    {
+        case kIOReturnSuccess:
+        {
+            that->m_interruptReadErrors = 0;
+            that->m_pCommandGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, that, &QCABluetoothFirmware::enqueueEventGated), (void *)(uintptr_t) bytesTransferred);
+            break;
+        }
+        case kIOReturnAborted:
+        case kIOReturnNotResponding:
+        case kIOReturnNoDevice:
+        {
+            /* Pipe is going away, do not re-arm */
+            DebugLog("(interruptReadHandler) Stopped reading events (status: 0x%x).\n", status);
+            return;
+        }
+        default:
+        {
+            ErrorLog("(interruptReadHandler) Failed to read event (status: 0x%x)!!!\n", status);
             
-            OSSafeReleaseNULL(memBuf);
-            safe_delete_arr(tempBuf);
+            /* A pipe that keeps failing would otherwise be re-armed forever */
+            if (++that->m_interruptReadErrors >= HCI_INTERRUPT_MAX_ERRORS)
+            {
+                ErrorLog("(interruptReadHandler) Giving up reading events after %u errors!!!\n", (unsigned int) that->m_interruptReadErrors);
+                return;
+            }
             
+            if (that->m_pInterruptReadPipe)
+            {
+                that->m_pInterruptReadPipe->clearStall(false);
+            }
+            break;
+        }
+    }
+    
+    if (that->m_pInterruptReadPipe && that->startInterruptRead())
+    {
+        ErrorLog("(interruptReadHandler) Failed to re-arm interrupt read!!!\n");
+    }
+}
+
+IOReturn QCABluetoothFirmware::enqueueEventGated(void * arg0, void * arg1, void * arg2, void * arg3)
+{
+    u32 length = (u32)(uintptr_t) arg0;
+    const u8 * data = (const u8 *) arg1;    /* NULL: read from the interrupt buffer */
+    HciEventSlot * slot;
+    
+    if (length < HCI_EVENT_HDR_SIZE || length > HCI_MAX_EVENT_SIZE)
+    {
+        ErrorLog("(enqueueEventGated) Dropping malformed event (len: %u)!!!\n", (unsigned int) length);
+        return kIOReturnBadArgument;
+    }
+    
+    /* Overwrite the oldest event rather than block the USB completion */
+    if (m_eventTail - m_eventHead == HCI_EVENT_RING_SIZE)
+    {
+        ErrorLog("(enqueueEventGated) Event ring full, dropping oldest event!!!\n");
+        ++m_eventHead;
+    }
+    
+    slot = &m_eventRing[m_eventTail % HCI_EVENT_RING_SIZE];
+    slot->length = length;
+    if (data)
+    {
+        memcpy(slot->data, data, length);
+    }
+    else
+    {
+        m_pInterruptReadBuffer->readBytes(0, slot->data, length);
+    }
+    ++m_eventTail;
+    
+    m_eventDispatcher.dispatch(slot->data, slot->length);
+    
+    m_pCommandGate->commandWakeup(m_eventRing);
+    
+    return kIOReturnSuccess;
+}
+
+IOReturn QCABluetoothFirmware::receiveHCIEvent(const u8 * data, u16 length)
+{
+    if (!m_pCommandGate)
+    {
+        return kIOReturnNotReady;
+    }
+    
+    return m_pCommandGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &QCABluetoothFirmware::enqueueEventGated), (void *)(uintptr_t) length, (void *) data);
+}
+
+/* A locally built event takes the same path as a received one: into the
+ * ring, out to the dispatcher's subscribers, waking any waiter.
+ */
+IOReturn QCABluetoothFirmware::injectHCIEvent(u8 event, const void * params, u8 paramLen)
+{
+    u8 buf[HCI_EVENT_HDR_SIZE + HCI_MAX_COMMAND_PLEN];
+    HciEventHdr * hdr = (HciEventHdr *) buf;
+    
+    hdr->evt = event;
+    hdr->plen = paramLen;
+    memcpy(buf + HCI_EVENT_HDR_SIZE, params, paramLen);
+    
+    DebugLog("(injectHCIEvent) Injecting event 0x%02x (len: %d).\n", event, paramLen);
+    
+    return receiveHCIEvent(buf, HCI_EVENT_HDR_SIZE + paramLen);
+}
+
+IOReturn QCABluetoothFirmware::injectCommandComplete(u16 opCode, u8 status)
+{
+    u8 params[HCI_CMD_COMPLETE_HDR_SIZE + 1];
+    
+    params[0] = 1;                      /* Num_HCI_Command_Packets */
+    params[1] = opCode & 0xff;
+    params[2] = opCode >> 8;
+    params[3] = status;
+    
+    return injectHCIEvent(HCI_EV_CMD_COMPLETE, params, sizeof(params));
+}
+
+void QCABluetoothFirmware::transportEventHandler(OSObject * owner, const u8 * data, u16 length)
+{
+    ((QCABluetoothFirmware *) owner)->receiveHCIEvent(data, length);
+}
+
+void QCABluetoothFirmware::hardwareErrorHandler(OSObject * owner, const u8 * data, u16 length)
+{
+    HciEventView evt(data, length);
+    
+    ErrorLog("(hardwareErrorHandler) Controller reported hardware error 0x%02x!!!\n", evt.paramLen() ? evt.params()[0] : 0);
+}
+
+IOReturn QCABluetoothFirmware::flushEventsGated(void * arg0, void * arg1, void * arg2, void * arg3)
+{
+    m_eventHead = m_eventTail;
+    return kIOReturnSuccess;
+}
+
+bool QCABluetoothFirmware::matchHCIEvent(HciEventSlot * slot, u16 opCode, u8 event)
+{
+    HciEventView evt(slot->data, slot->length);
+    
+    if (!evt.isValid())
+    {
+        return false;
+    }
+    
+    /* A specific event was asked for (e.g. vendor specific event), it does
+     * not name the command, so the HAL tells whether it is the answer.
+     */
+    if (event)
+    {
+        if (evt.code() != event || !isHCIReply(opCode, evt.params(), evt.paramLen()))
+        {
             return false;
         }
         
-        DebugLog("(loadFirmware) Loaded firmware to bulk pipe block %d.\n", i);
+        m_hciEventData = (u8 *) evt.params();
+        m_hciEventLen = evt.paramLen();
         
-        memBuf->complete();
-        OSSafeReleaseNULL(memBuf);
-        safe_delete_arr(tempBuf);
+        return true;
+    }
+    
+    HciCmdCompleteView cc(slot->data, slot->length);
+    
+    if (cc.isValid())
+    {
+        /* Vendor opcodes are shared by several requests */
+        if (cc.opcode() != opCode || !isHCIReply(opCode, cc.returnParams(), cc.returnParamLen()))
+        {
+            return false;
+        }
         
-        sendBuf += toSend;
-        size    -= toSend;
+        /* Hand out the return parameters only, starting with status */
+        m_hciEventData = (u8 *) cc.returnParams();
+        m_hciEventLen = cc.returnParamLen();
         
-        ++i; /* Going to the next block... */
+        return true;
     }
     
-    DebugLog("(loadFirmware) Successfully loaded firmware.\n");
+    HciCmdStatusView cs(slot->data, slot->length);
     
-    return true;
+    if (cs.isValid())
+    {
+        if (cs.opcode() != opCode)
+        {
+            return false;
+        }
+        
+        m_hciEventData = (u8 *) cs.params();
+        m_hciEventLen = 1;
+        
+        return true;
+    }
+    
+    return false;
+}
+
+IOReturn QCABluetoothFirmware::waitForHCIEventGated(void * arg0, void * arg1, void * arg2, void * arg3)
+{
+    u16 opCode = (u16)(uintptr_t) arg0;
+    u8 event = (u8)(uintptr_t) arg1;
+    UInt64 deadline = (UInt64)(uintptr_t) arg2;
+    HciEventSlot * slot;
+    
+    while (1)
+    {
+        while (m_eventHead != m_eventTail)
+        {
+            slot = &m_eventRing[m_eventHead % HCI_EVENT_RING_SIZE];
+            ++m_eventHead;
+            
+            if (matchHCIEvent(slot, opCode, event))
+            {
+                m_hciEvent = slot;
+                return kIOReturnSuccess;
+            }
+            
+            DebugLog("(waitForHCIEventGated) Skipping event 0x%02x while waiting for 0x%04x.\n", slot->data[0], opCode);
+        }
+        
+        if (!hasEventSource())
+        {
+            return kIOReturnNotResponding;
+        }
+        
+        if (m_pCommandGate->commandSleep(m_eventRing, deadline, THREAD_UNINT) == THREAD_TIMED_OUT)
+        {
+            return kIOReturnTimeout;
+        }
+    }
 }
 
 inline bool QCABluetoothFirmware::isAth3K()
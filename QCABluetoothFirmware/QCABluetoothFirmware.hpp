@@ -28,16 +28,29 @@
 #include <IOKit/IOService.h>
 #include <IOKit/IOLib.h>
 #include <IOKit/IOMessage.h>
+#include <IOKit/IOWorkLoop.h>
+#include <IOKit/IOCommandGate.h>
+#include <IOKit/IOBufferMemoryDescriptor.h>
 
 #include <IOKit/usb/IOUSBHostDevice.h>
 #include <IOKit/usb/IOUSBHostInterface.h>
 #include <IOKit/usb/USB.h>
+#include <IOKit/serial/IOSerialStreamSync.h>
+#include <kern/thread_call.h>
 
-#include <Hci.h>
+#include <HciEventDispatcher.h>
+#include <QCATransport.h>
 #include <Firmware.h>
 
 #define BULK_SIZE                   4096
 
+#define QCA_FW_STATE_PROPERTY       "QCAFirmwareState"
+#define QCA_FW_QUEUE_DELAY_PROPERTY "QCAFirmwareQueueDelay"
+
+/* Sent to clients when the bring-up ends, see setBringUpState */
+#define kQCAMessageFirmwareReady    iokit_vendor_specific_msg(1)
+#define kQCAMessageFirmwareFailed   iokit_vendor_specific_msg(2)
+
 #define QCA_DOWNLOAD                0x01
 #define QCA_GET_STATUS              0x05
 #define QCA_GET_VERSION             0x09
@@ -62,6 +75,9 @@
 
 #define CONFIG_INDEX                0
 
+#define HCI_EVENT_RING_SIZE         8
+#define HCI_INTERRUPT_MAX_ERRORS    5       /* failed reads in a row before giving up on the pipe */
+
 #define 
 
 enum SocType
@@ -80,6 +96,17 @@ enum SocType
     QCA_QCA6390
 };
 
+/* Idle -> Queued -> Loading -> Ready, Switched or Failed, back to Idle when stopped early */
+enum QCABringUpState
+{
+    QCA_BRINGUP_IDLE,
+    QCA_BRINGUP_QUEUED,     /* waiting for a slot in QCABringUpScheduler */
+    QCA_BRINGUP_LOADING,
+    QCA_BRINGUP_READY,
+    QCA_BRINGUP_FAILED,
+    QCA_BRINGUP_SWITCHED    /* loaded, the device re-enumerates and is Ready as its new self */
+};
+
 struct USB_DEVICE
 {
     int vendorID;
@@ -203,10 +230,20 @@ struct QCARamPatchVersion
 
 struct QCADeviceInfo
 {
-    u32       romVersion;
-    u8        ramPatchHdr;      /* length of header in rampatch */
-    u8        nvmHdr;           /* length of header in NVM */
-    u8        versionOffset;    /* offset of version structure in rampatch */
+    u32             romVersion;
+    u8              ramPatchHdr;      /* length of header in rampatch */
+    u8              nvmHdr;           /* length of header in NVM */
+    u8              versionOffset;    /* offset of version structure in rampatch */
+    const char  *   rampatch;
+    const char  *   nvm;              /* board specific NVMs are picked at runtime */
+};
+
+/* A USB download that is ready to go: bounds checked, bounce buffer prepared */
+struct QCAFirmwareImage
+{
+    OSData                      *   data;
+    size_t                          headerSize;
+    IOBufferMemoryDescriptor    *   bounce;
 };
 
 struct EdlEventHdr
@@ -223,9 +260,11 @@ struct TlvPatch
     UInt8       format_version;
     UInt8       signature;
     UInt8       download_mode;
+    UInt8       reserved1;
     SInt16      product_id;
     SInt16      rom_build;
     SInt16      patch_version;
+    SInt16      reserved2;
     SInt32      entry;
 } __packed;
 
@@ -233,6 +272,8 @@ struct TlvNvm
 {
     SInt16      tag_id;
     SInt16      tag_len;
+    SInt32      reserve1;
+    SInt32      reserve2;
     UInt8       data[];
 } __packed;
 
@@ -286,7 +327,8 @@ enum TlvType
 {
     TLV_TYPE_INVALID = 0,
     TLV_TYPE_PATCH,
-    TLV_TYPE_NVM
+    TLV_TYPE_NVM,
+    TLV_TYPE_MULTI = 4      /* container of several TLV records */
 };
 
 struct bdaddr_t
@@ -294,6 +336,12 @@ struct bdaddr_t
     uint8_t b[6];
 } __packed;
 
+struct HciEventSlot
+{
+    u16         length;
+    u8          data[HCI_MAX_EVENT_SIZE];
+};
+
 class QCABluetoothFirmware : public IOService
 {
     OSDeclareDefaultStructors(QCABluetoothFirmware)
@@ -328,24 +376,77 @@ public:
                                 unsigned long       powerStateOrdinal,
                                 IOService       *   whatDevice              ) override;
     
+    QCABringUpState         getBringUpState()       { return m_bringUpState; }
+    
 protected:
     bool                    isAth3K();
     bool                    isQcaUsb();
     bool                    isQcaSoc();
     void                    releaseAll();
-    IOReturn                sendVendorRequestIn(u8 bRequest, void * dataBuffer, UInt16 size);
-    IOReturn                sendVendorRequestOut(u8 bRequest, void * dataBuffer, UInt16 size);
-    IOReturn                sendHCIRequest(u16 opCode, u8 paramLen, const void * param);
+    IOReturn                sendVendorRequestIn(u8 bRequest, void * dataBuffer, UInt16 size, UInt32 timeout = kUSBHostStandardRequestCompletionTimeout);
+    IOReturn                sendVendorRequestOut(u8 bRequest, void * dataBuffer, UInt16 size, UInt32 timeout = kUSBHostStandardRequestCompletionTimeout);
+    IOReturn                sendHCIRequest(u16 opCode, u8 paramLen, const void * param, u8 event = 0, UInt32 timeout = HCI_CMD_TIMEOUT);
+    IOReturn                submitHCIRequest(u16 opCode, u8 paramLen, const void * param, UInt32 timeout = HCI_CMD_TIMEOUT);
+    u8                  *   getHCICommandParams()   { return m_hciCommand->pData; }
+    IOReturn                waitHCIReply(u16 opCode, u8 event = 0, UInt32 timeout = HCI_CMD_TIMEOUT);
+    IOReturn                waitHCIReplyUntil(u16 opCode, u8 event, UInt64 deadline);
+    
+    /* Whether the parameters of an event matched by code or opcode answer
+     * opCode, for HALs whose replies carry more than that.
+     */
+    virtual bool            isHCIReply(u16 opCode, const u8 * params, u8 len)    { return true; }
+    IOReturn                receiveHCIEvent(const u8 * data, u16 length);
+    IOReturn                injectHCIEvent(u8 event, const void * params, u8 paramLen);
+    IOReturn                injectCommandComplete(u16 opCode, u8 status);
+    bool                    hasEventSource()        { return m_pInterruptReadPipe || m_pTransport; }
     bool                    resetDevice();
+    
+    /* True when the device already runs the firmware and nothing has to
+     * be loaded, answered with as few transfers as the HAL allows.
+     */
+    virtual bool            isProvisioned()         { return false; }
+    
+    /* The HAL's download, run by startBringUp on a thread call of its own */
+    virtual bool            bringUpDevice()         { return true; }
+    /* What a successful bring-up leaves the driver in */
+    virtual QCABringUpState getLoadedState()        { return QCA_BRINGUP_READY; }
+    bool                    startBringUp(bool ackPowerState = false);
+    void                    waitBringUp(bool abort);
+    static void             bringUpCall(thread_call_param_t param0, thread_call_param_t param1);
+    void                    setBringUpState(QCABringUpState state);
     void                    powerStart( IOService * provider );
     bool                    initUSBConfiguration();
     bool                    initInterface();
     bool                    loadFirmware(OSData * fwData, size_t headerSize);
+    bool                    loadFirmware(const QCAFirmwareImage * image);
+    bool                    prepareFirmware(OSData * fwData, size_t headerSize, QCAFirmwareImage * image);
+    void                    releaseFirmware(QCAFirmwareImage * image);
+    bool                    sendFirmware(const QCAFirmwareImage * image);
+    bool                    scheduleDownload(u32 bytes, int * ticket);
+    void                    finishDownload(int ticket);
+    
+    bool                    initCommandGate();
+    void                    releaseCommandGate();
+    IOReturn                startInterruptRead();
+    static void             interruptReadHandler(void * owner, void * parameter, IOReturn status, uint32_t bytesTransferred);
+    IOReturn                enqueueEventGated(void * arg0, void * arg1, void * arg2, void * arg3);
+    IOReturn                flushEventsGated(void * arg0, void * arg1, void * arg2, void * arg3);
+    IOReturn                waitForHCIEventGated(void * arg0, void * arg1, void * arg2, void * arg3);
+    bool                    matchHCIEvent(HciEventSlot * slot, u16 opCode, u8 event);
+    static void             hardwareErrorHandler(OSObject * owner, const u8 * data, u16 length);
+    static void             transportEventHandler(OSObject * owner, const u8 * data, u16 length);
     
 public:
     IOUSBHostDevice             *       m_pUSBDevice;
     IOUSBHostInterface          *       m_pInterface;
     IOUSBHostPipe               *       m_pBulkWritePipe;
+    IOUSBHostPipe               *       m_pInterruptReadPipe;
+    
+    /* Set when the controller is not reached over USB (e.g. UART) */
+    QCATransport                *       m_pTransport;
+    
+    IOWorkLoop                  *       m_pWorkLoop;
+    IOCommandGate               *       m_pCommandGate;
 
     int                                 m_socType;
     
@@ -361,7 +462,7 @@ public:
 #if isQcaUSB()
     QCAVersion                  *       m_fwVersion;
     QCARamPatchVersion          *       m_rpVersion; //used for getting ram patch name
-    QCADeviceInfo               *       m_devInfo; //used for getting USB firmware name
+    const QCADeviceInfo         *       m_devInfo; //used for getting USB firmware name
 #endif
     
 #if isQcaSoc()
@@ -372,6 +473,34 @@ protected:
     OSData                      *       m_fwData;
     HciCommandHdr               *       m_hciCommand;
     
+    IOBufferMemoryDescriptor    *       m_pInterruptReadBuffer;
+    IOUSBHostCompletion                 m_interruptReadCompletion;
+    u32                                 m_interruptReadErrors;
+    
+    /* Events read from the interrupt pipe, consumed by sendHCIRequest */
+    HciEventSlot                        m_eventRing[HCI_EVENT_RING_SIZE];
+    u32                                 m_eventHead;
+    u32                                 m_eventTail;
+    
+    /* Subsystems subscribe here for events outside of command replies */
+    HciEventDispatcher                  m_eventDispatcher;
+    
+    /* Set while bringUpDevice runs or waits for a slot */
+    thread_call_t                       m_bringUpCall;
+    IOLock                      *       m_bringUpLock;
+    bool                                m_bringUpRunning;
+    bool                                m_bringUpAbort;
+    bool                                m_bringUpAckPower;      /* acknowledgeSetPowerState once done */
+    QCABringUpState                     m_bringUpState;
+    
+    /* Time spent waiting behind other downloads on the same hub */
+    u64                                 m_queueDelay;
+    
+    /* Parameters of the event that completed the last sendHCIRequest */
+    HciEventSlot                *       m_hciEvent;
+    u8                          *       m_hciEventData;
+    u8                                  m_hciEventLen;
+    
 #if isAth3K()
     char                                m_fwFilename[ATH3K_NAME_LEN];
 #endif
@@ -0,0 +1,212 @@
+//
+//  QCABringUpScheduler.cpp
+//  QCABluetoothFirmware
+//
+//  Copyright © 2021 cjiang. All rights reserved.
+//
+
+#include "QCABringUpScheduler.hpp"
+#include "QCAModule.hpp"
+
+u32 QCABringUpScheduler::s_active = 0;
+QCADownloadTicket QCABringUpScheduler::s_downloads[QCA_MAX_DOWNLOADS];
+
+/* Blocks until fewer than limit bring-ups run, false once abort is set
+ * while waiting. A limit of 0 does not cap them.
+ */
+bool QCABringUpScheduler::acquire(u32 limit, volatile bool * abort)
+{
+    bool ret;
+
+    IOLockLock(g_pSharedLock);
+
+    while (!* abort && limit && s_active >= limit)
+    {
+        IOLockSleep(g_pSharedLock, &s_active, THREAD_UNINT);
+    }
+
+    if ((ret = !* abort))
+    {
+        ++s_active;
+    }
+
+    IOLockUnlock(g_pSharedLock);
+    return ret;
+}
+
+/* Limits differ between personalities, so everyone waiting takes a look */
+void QCABringUpScheduler::release()
+{
+    IOLockLock(g_pSharedLock);
+
+    --s_active;
+    IOLockWakeup(g_pSharedLock, &s_active, false);
+
+    IOLockUnlock(g_pSharedLock);
+}
+
+/* Set the abort flag first, the bring-up waiting on it returns then */
+void QCABringUpScheduler::wakeAll()
+{
+    IOLockLock(g_pSharedLock);
+
+    IOLockWakeup(g_pSharedLock, &s_active, false);
+    IOLockWakeup(g_pSharedLock, s_downloads, false);
+
+    IOLockUnlock(g_pSharedLock);
+}
+
+/* Blocks until the hub has room, -1 for devices that are not behind one
+ * and once abort is set while waiting, the caller tells them apart.
+ */
+int QCABringUpScheduler::acquireDownload(IOService * device, u32 bytes, volatile bool * abort, u64 * delayMs)
+{
+    u32 hubID = device ? getHubID(device) : 0;
+    u64 queueTime = mach_absolute_time();
+    u64 ns;
+    int ticket;
+
+    * delayMs = 0;
+
+    if (!hubID)
+    {
+        return -1;
+    }
+
+    IOLockLock(g_pSharedLock);
+
+    for (;;)
+    {
+        if (* abort)
+        {
+            IOLockUnlock(g_pSharedLock);
+            return -1;
+        }
+
+        for (ticket = 0; ticket < QCA_MAX_DOWNLOADS && s_downloads[ticket].hubID; ++ticket);
+
+        if (ticket < QCA_MAX_DOWNLOADS)
+        {
+            break;
+        }
+
+        IOLockSleep(g_pSharedLock, s_downloads, THREAD_UNINT);
+    }
+
+    s_downloads[ticket].hubID = hubID;
+    s_downloads[ticket].bytes = bytes;
+    s_downloads[ticket].queueTime = queueTime;
+    s_downloads[ticket].running = false;
+
+    while (!* abort && !canRun(&s_downloads[ticket]))
+    {
+        IOLockSleep(g_pSharedLock, s_downloads, THREAD_UNINT);
+    }
+
+    /* Whoever queued behind this one may go now */
+    if (* abort)
+    {
+        bzero(&s_downloads[ticket], sizeof(QCADownloadTicket));
+        IOLockWakeup(g_pSharedLock, s_downloads, false);
+
+        IOLockUnlock(g_pSharedLock);
+        return -1;
+    }
+
+    s_downloads[ticket].running = true;
+
+    IOLockUnlock(g_pSharedLock);
+
+    absolutetime_to_nanoseconds(mach_absolute_time() - queueTime, &ns);
+    * delayMs = ns / 1000000;
+
+    return ticket;
+}
+
+void QCABringUpScheduler::releaseDownload(int ticket)
+{
+    if (ticket < 0)
+    {
+        return;
+    }
+
+    IOLockLock(g_pSharedLock);
+
+    bzero(&s_downloads[ticket], sizeof(QCADownloadTicket));
+    IOLockWakeup(g_pSharedLock, s_downloads, false);
+
+    IOLockUnlock(g_pSharedLock);
+}
+
+/* Called with g_pSharedLock held */
+bool QCABringUpScheduler::canRun(const QCADownloadTicket * ticket)
+{
+    u64 now = mach_absolute_time();
+    u32 inflight = 0;
+
+    for (int i = 0; i < QCA_MAX_DOWNLOADS; ++i)
+    {
+        const QCADownloadTicket * other = &s_downloads[i];
+
+        if (other == ticket || other->hubID != ticket->hubID)
+        {
+            continue;
+        }
+
+        if (other->running)
+        {
+            inflight += other->bytes;
+        }
+        else if (goesFirst(other, ticket, now))
+        {
+            return false;
+        }
+    }
+
+    return !inflight || inflight + ticket->bytes <= QCA_HUB_MAX_INFLIGHT;
+}
+
+/* Those past QCA_DOWNLOAD_MAX_WAIT in order of arrival, then the rest
+ * smaller ones first and again in order of arrival.
+ */
+bool QCABringUpScheduler::goesFirst(const QCADownloadTicket * ticket, const QCADownloadTicket * other, u64 now)
+{
+    u64 maxWait;
+    bool ticketAged, otherAged;
+
+    clock_interval_to_absolutetime_interval(QCA_DOWNLOAD_MAX_WAIT, kMillisecondScale, &maxWait);
+
+    ticketAged = now - ticket->queueTime >= maxWait;
+    otherAged = now - other->queueTime >= maxWait;
+
+    if (ticketAged != otherAged)
+    {
+        return ticketAged;
+    }
+
+    if (!ticketAged && ticket->bytes != other->bytes)
+    {
+        return ticket->bytes < other->bytes;
+    }
+
+    return ticket->queueTime < other->queueTime;
+}
+
+/* The locationID is 0xBBPPPPPP, one nibble per port from the root down, so
+ * dropping the device's own (lowest non-zero) port gives the hub it is on.
+ */
+u32 QCABringUpScheduler::getHubID(IOService * device)
+{
+    OSNumber * number = OSDynamicCast(OSNumber, device->getProperty(kUSBHostDevicePropertyLocationID));
+    u32 locationID = number ? number->unsigned32BitValue() : 0;
+
+    for (int shift = 0; shift < 24; shift += 4)
+    {
+        if (locationID & (0xfU << shift))
+        {
+            return locationID & ~(0xfU << shift);
+        }
+    }
+
+    return locationID;
+}
@@ -0,0 +1,63 @@
+//
+//  QCABringUpScheduler.hpp
+//  QCABluetoothFirmware
+//
+//  Copyright © 2021 cjiang. All rights reserved.
+//
+
+#ifndef QCABringUpScheduler_hpp
+#define QCABringUpScheduler_hpp
+
+#include "QCABluetoothFirmware.hpp"
+
+#define QCA_MAX_CONCURRENT_BRINGUPS     0           /* none, unless MaxConcurrentBringUps sets one */
+#define QCA_MAX_DOWNLOADS               8           /* queued or running at once */
+#define QCA_HUB_MAX_INFLIGHT            (96 * 1024) /* bytes downloading behind one hub */
+#define QCA_DOWNLOAD_MAX_WAIT           2000        /* ms before smaller downloads stop passing one */
+
+/* A download behind a USB hub */
+struct QCADownloadTicket
+{
+    u32                     hubID;              /* 0 if the slot is free */
+    u32                     bytes;
+    u64                     queueTime;
+    bool                    running;
+};
+
+/* Orders the firmware downloads of devices coming up at once.
+ *
+ * Every driver instance brings its device up on its own thread call, so a
+ * dock with several adapters does not load them one after another from the
+ * matching thread. What they contend for is the hub: each USB download
+ * takes a ticket for the hub the device hangs off. Downloads behind one
+ * hub are kept under QCA_HUB_MAX_INFLIGHT bytes (a single larger one runs
+ * alone), and the smallest waiting download goes next so small parts are
+ * ready first. Once one has waited QCA_DOWNLOAD_MAX_WAIT, it goes ahead of
+ * the younger ones whatever its size, so a steady stream of small images
+ * cannot hold a large one back. UART devices share nothing and are not
+ * queued.
+ *
+ * MaxConcurrentBringUps can still cap the bring-ups as a whole. One that
+ * is stopped while queued, for it or for its hub, is woken by wakeAll and
+ * gives up its turn.
+ */
+class QCABringUpScheduler
+{
+public:
+    static bool             acquire(u32 limit, volatile bool * abort);
+    static void             release();
+    static void             wakeAll();
+
+    static int              acquireDownload(IOService * device, u32 bytes, volatile bool * abort, u64 * delayMs);
+    static void             releaseDownload(int ticket);
+
+private:
+    static bool             canRun(const QCADownloadTicket * ticket);
+    static bool             goesFirst(const QCADownloadTicket * ticket, const QCADownloadTicket * other, u64 now);
+    static u32              getHubID(IOService * device);
+
+    static u32              s_active;
+    static QCADownloadTicket s_downloads[QCA_MAX_DOWNLOADS];
+};
+
+#endif /* QCABringUpScheduler_hpp */
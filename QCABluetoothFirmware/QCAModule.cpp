@@ -0,0 +1,44 @@
+//
+//  QCAModule.cpp
+//  QCABluetoothFirmware
+//
+//  Copyright © 2021 cjiang. All rights reserved.
+//
+
+#include <mach/kmod.h>
+#include "QCAModule.hpp"
+#include "Ath3KReenumTracker.hpp"
+
+IOLock * g_pSharedLock = NULL;
+
+/* State shared by every driver instance lives from here to the stop
+ * routine, which only runs once no instance is left.
+ */
+extern "C" kern_return_t QCABluetoothFirmware_start(kmod_info_t * ki, void * data)
+{
+    if (!(g_pSharedLock = IOLockAlloc()))
+    {
+        ErrorLog("(QCABluetoothFirmware_start) Unable to allocate shared lock!!!\n");
+        return KERN_FAILURE;
+    }
+    
+    if (!Ath3KReenumTracker::init())
+    {
+        ErrorLog("(QCABluetoothFirmware_start) Failed to set up the re-enumeration tracker!!!\n");
+        IOLockFree(g_pSharedLock);
+        g_pSharedLock = NULL;
+        return KERN_FAILURE;
+    }
+    
+    return KERN_SUCCESS;
+}
+
+extern "C" kern_return_t QCABluetoothFirmware_stop(kmod_info_t * ki, void * data)
+{
+    Ath3KReenumTracker::free();
+    
+    IOLockFree(g_pSharedLock);
+    g_pSharedLock = NULL;
+    
+    return KERN_SUCCESS;
+}
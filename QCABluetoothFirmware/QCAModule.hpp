@@ -0,0 +1,19 @@
+//
+//  QCAModule.hpp
+//  QCABluetoothFirmware
+//
+//  Copyright © 2021 cjiang. All rights reserved.
+//
+
+#ifndef QCAModule_hpp
+#define QCAModule_hpp
+
+#include <IOKit/IOLocks.h>
+
+/* Allocated by the kext's start routine before any driver can probe and
+ * freed by its stop routine. Guards the state the driver instances share:
+ * QCABringUpScheduler, QCAProvisionCache and Ath3KReenumTracker.
+ */
+extern IOLock * g_pSharedLock;
+
+#endif /* QCAModule_hpp */
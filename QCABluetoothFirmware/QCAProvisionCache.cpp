@@ -0,0 +1,134 @@
+//
+//  QCAProvisionCache.cpp
+//  QCABluetoothFirmware
+//
+//  Copyright © 2021 cjiang. All rights reserved.
+//
+
+#include "QCAProvisionCache.hpp"
+#include "QCAModule.hpp"
+
+QCAProvisionRecord QCAProvisionCache::s_records[QCA_PROVISION_MAX_DEVICES];
+
+/* The versions are what the device reports now */
+bool QCAProvisionCache::find(IOUSBHostDevice * device, u32 romVersion, u32 patchVersion)
+{
+    char serial[QCA_PROVISION_SERIAL_LEN];
+    QCAProvisionRecord * record;
+    QCAProvisionRecord stale;
+    u32 locationID;
+    bool found = false;
+
+    if (!getIdentity(device, &locationID, serial))
+    {
+        return false;
+    }
+
+    bzero(&stale, sizeof(stale));
+
+    IOLockLock(g_pSharedLock);
+
+    if ((record = lookup(locationID, serial)))
+    {
+        if (record->romVersion == romVersion && record->patchVersion == patchVersion)
+        {
+            found = true;
+        }
+        else
+        {
+            stale = * record;
+            bzero(record, sizeof(QCAProvisionRecord));
+        }
+    }
+
+    IOLockUnlock(g_pSharedLock);
+
+    if (stale.locationID)
+    {
+        InfoLog("(find) 0x%08x runs rom 0x%08x with patch 0x%08x, not the recorded 0x%08x with 0x%08x.\n", locationID, romVersion, patchVersion, stale.romVersion, stale.patchVersion);
+    }
+
+    return found;
+}
+
+void QCAProvisionCache::save(IOUSBHostDevice * device, u32 romVersion, u32 patchVersion)
+{
+    char serial[QCA_PROVISION_SERIAL_LEN];
+    QCAProvisionRecord * record;
+    u32 locationID;
+
+    if (!getIdentity(device, &locationID, serial))
+    {
+        return;
+    }
+
+    IOLockLock(g_pSharedLock);
+
+    /* The port may have seen another device, its record is stale then */
+    if (!(record = lookup(locationID, serial)) && !(record = lookup(locationID, NULL)) && !(record = lookup(0, NULL)))
+    {
+        /* Full, the first record gives way */
+        memmove(&s_records[0], &s_records[1], sizeof(s_records) - sizeof(QCAProvisionRecord));
+        record = &s_records[QCA_PROVISION_MAX_DEVICES - 1];
+    }
+
+    record->locationID = locationID;
+    strlcpy(record->serial, serial, sizeof(record->serial));
+    record->romVersion = romVersion;
+    record->patchVersion = patchVersion;
+
+    IOLockUnlock(g_pSharedLock);
+
+    DebugLog("(save) Provisioned 0x%08x (rom: 0x%08x, patch: 0x%08x).\n", locationID, romVersion, patchVersion);
+}
+
+void QCAProvisionCache::forget(IOUSBHostDevice * device)
+{
+    char serial[QCA_PROVISION_SERIAL_LEN];
+    QCAProvisionRecord * record;
+    u32 locationID;
+
+    if (!getIdentity(device, &locationID, serial))
+    {
+        return;
+    }
+
+    IOLockLock(g_pSharedLock);
+
+    if ((record = lookup(locationID, serial)))
+    {
+        bzero(record, sizeof(QCAProvisionRecord));
+    }
+
+    IOLockUnlock(g_pSharedLock);
+}
+
+/* Devices without a serial number are told apart by their port alone */
+bool QCAProvisionCache::getIdentity(IOUSBHostDevice * device, u32 * locationID, char * serial)
+{
+    OSNumber * location = OSDynamicCast(OSNumber, device->getProperty(kUSBHostDevicePropertyLocationID));
+    OSString * serialNumber = OSDynamicCast(OSString, device->getProperty(kUSBSerialNumberString));
+
+    if (!location || !location->unsigned32BitValue())
+    {
+        return false;
+    }
+
+    * locationID = location->unsigned32BitValue();
+    strlcpy(serial, serialNumber ? serialNumber->getCStringNoCopy() : "", QCA_PROVISION_SERIAL_LEN);
+
+    return true;
+}
+
+/* Called with g_pSharedLock held, a NULL serial matches any */
+QCAProvisionRecord * QCAProvisionCache::lookup(u32 locationID, const char * serial)
+{
+    for (int i = 0; i < QCA_PROVISION_MAX_DEVICES; ++i)
+    {
+        if (s_records[i].locationID == locationID && (!serial || !strncmp(s_records[i].serial, serial, QCA_PROVISION_SERIAL_LEN)))
+        {
+            return &s_records[i];
+        }
+    }
+    return NULL;
+}
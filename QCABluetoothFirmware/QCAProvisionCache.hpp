@@ -0,0 +1,47 @@
+//
+//  QCAProvisionCache.hpp
+//  QCABluetoothFirmware
+//
+//  Copyright © 2021 cjiang. All rights reserved.
+//
+
+#ifndef QCAProvisionCache_hpp
+#define QCAProvisionCache_hpp
+
+#include "QCABluetoothFirmware.hpp"
+
+#define QCA_PROVISION_MAX_DEVICES       8
+#define QCA_PROVISION_SERIAL_LEN        32
+
+/* A download that finished on a device */
+struct QCAProvisionRecord
+{
+    u32                     locationID;         /* 0 if the slot is free */
+    char                    serial[QCA_PROVISION_SERIAL_LEN];
+    u32                     romVersion;
+    u32                     patchVersion;
+};
+
+/* Devices this kext has provisioned, by port and serial number.
+ *
+ * Kept for the lifetime of the kext, so it survives the driver instance
+ * and the IOUSBHostDevice being torn down by sleep or a hub reset. It is
+ * only trusted together with the device's own state bits and the version
+ * it reports: a device that lost its patch, or runs another one than was
+ * recorded after the download, is forgotten.
+ */
+class QCAProvisionCache
+{
+public:
+    static bool             find(IOUSBHostDevice * device, u32 romVersion, u32 patchVersion);
+    static void             save(IOUSBHostDevice * device, u32 romVersion, u32 patchVersion);
+    static void             forget(IOUSBHostDevice * device);
+
+private:
+    static bool             getIdentity(IOUSBHostDevice * device, u32 * locationID, char * serial);
+    static QCAProvisionRecord * lookup(u32 locationID, const char * serial);
+
+    static QCAProvisionRecord s_records[QCA_PROVISION_MAX_DEVICES];
+};
+
+#endif /* QCAProvisionCache_hpp */
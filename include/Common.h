@@ -94,6 +94,16 @@ static inline u32 get_unaligned_le32(const void *p)
     return __le32_to_cpup((__le32 *) p);
 }
 
+static inline u16 get_unaligned_le16(const void *p)
+{
+    return __le16_to_cpu(*(__le16 *) p);
+}
+
+static inline u16 get_unaligned_be16(const void *p)
+{
+    return (((const u8 *) p)[0] << 8) | ((const u8 *) p)[1];
+}
+
 #define safe_delete(x) do { if (x) { delete x; x = NULL; } } while (0)
 #define safe_delete_arr(x) do { if (x) { delete[] x; x = NULL; } } while (0)
 
@@ -27,6 +27,7 @@
 #ifndef Firmware_h
 #define Firmware_h
 
+#include <libkern/libkern.h>
 #include <libkern/c++/OSData.h>
 
 #include <FIRMWARE_ATHRBT.h>
@@ -42,73 +43,97 @@ struct FwDesc
 {
     const char              *name;
     const unsigned char     *var;
+    size_t                  size;
 };
 
-const FwDesc fwList[] =
+#define FW_DESC(name, var)  { name, var, sizeof(var) }
+
+constexpr FwDesc fwList[] =
 {
-    {      "AthrBT_0x01020001.dfu",     AthrBT_0x01020001_dfu      },
-    {      "AthrBT_0x01020200.dfu",     AthrBT_0x01020200_dfu      },
-    {      "AthrBT_0x01020201.dfu",     AthrBT_0x01020201_dfu      },
-    {      "AthrBT_0x11020000.dfu",     AthrBT_0x11020000_dfu      },
-    {      "AthrBT_0x11020100.dfu",     AthrBT_0x11020100_dfu      },
-    {      "AthrBT_0x31010000.dfu",     AthrBT_0x31010000_dfu      },
-    {      "AthrBT_0x31010100.dfu",     AthrBT_0x31010100_dfu      },
-    {      "AthrBT_0x41020000.dfu",     AthrBT_0x41020000_dfu      },
+    FW_DESC(    "AthrBT_0x01020001.dfu",       AthrBT_0x01020001_dfu      ),
+    FW_DESC(    "AthrBT_0x01020200.dfu",       AthrBT_0x01020200_dfu      ),
+    FW_DESC(    "AthrBT_0x01020201.dfu",       AthrBT_0x01020201_dfu      ),
+    FW_DESC(    "AthrBT_0x11020000.dfu",       AthrBT_0x11020000_dfu      ),
+    FW_DESC(    "AthrBT_0x11020100.dfu",       AthrBT_0x11020100_dfu      ),
+    FW_DESC(    "AthrBT_0x31010000.dfu",       AthrBT_0x31010000_dfu      ),
+    FW_DESC(    "AthrBT_0x31010100.dfu",       AthrBT_0x31010100_dfu      ),
+    FW_DESC(    "AthrBT_0x41020000.dfu",       AthrBT_0x41020000_dfu      ),
     
-    {      "ramps_0x01020001_26.dfu",   ramps_0x01020001_26_dfu    },
-    {      "ramps_0x01020200_26.dfu",   ramps_0x01020200_26_dfu    },
-    {      "ramps_0x01020200_40.dfu",   ramps_0x01020200_40_dfu    },
-    {      "ramps_0x01020201_26.dfu",   ramps_0x01020201_26_dfu    },
-    {      "ramps_0x01020201_40.dfu",   ramps_0x01020201_40_dfu    },
-    {      "ramps_0x11020000_40.dfu",   ramps_0x11020000_40_dfu    },
-    {      "ramps_0x11020100_40.dfu",   ramps_0x11020100_40_dfu    },
-    {      "ramps_0x31010000_40.dfu",   ramps_0x31010000_40_dfu    },
-    {      "ramps_0x31010100_40.dfu",   ramps_0x31010100_40_dfu    },
-    {      "ramps_0x41020000_40.dfu",   ramps_0x41020000_40_dfu    },
+    FW_DESC(    "ramps_0x01020001_26.dfu",     ramps_0x01020001_26_dfu    ),
+    FW_DESC(    "ramps_0x01020200_26.dfu",     ramps_0x01020200_26_dfu    ),
+    FW_DESC(    "ramps_0x01020200_40.dfu",     ramps_0x01020200_40_dfu    ),
+    FW_DESC(    "ramps_0x01020201_26.dfu",     ramps_0x01020201_26_dfu    ),
+    FW_DESC(    "ramps_0x01020201_40.dfu",     ramps_0x01020201_40_dfu    ),
+    FW_DESC(    "ramps_0x11020000_40.dfu",     ramps_0x11020000_40_dfu    ),
+    FW_DESC(    "ramps_0x11020100_40.dfu",     ramps_0x11020100_40_dfu    ),
+    FW_DESC(    "ramps_0x31010000_40.dfu",     ramps_0x31010000_40_dfu    ),
+    FW_DESC(    "ramps_0x31010100_40.dfu",     ramps_0x31010100_40_dfu    ),
+    FW_DESC(    "ramps_0x41020000_40.dfu",     ramps_0x41020000_40_dfu    ),
     
-    {      "crbtfw21.tlv",              crbtfw21_tlv               },
-    {      "crbtfw32.tlv",              crbtfw32_tlv               },
-    {      "htbtfw20.tlv",              htbtfw20_tlv               },
+    FW_DESC(    "crbtfw21.tlv",                crbtfw21_tlv               ),
+    FW_DESC(    "crbtfw32.tlv",                crbtfw32_tlv               ),
+    FW_DESC(    "htbtfw20.tlv",                htbtfw20_tlv               ),
     
-    {      "rampatch_00130300.bin",     rampatch_00130300_bin      },
-    {      "rampatch_00130302.bin",     rampatch_00130302_bin      },
-    {      "rampatch_00230302.bin",     rampatch_00230302_bin      },
-    {      "rampatch_00440302.bin",     rampatch_00440302_bin      },
+    FW_DESC(    "rampatch_00130300.bin",       rampatch_00130300_bin      ),
+    FW_DESC(    "rampatch_00130302.bin",       rampatch_00130302_bin      ),
+    FW_DESC(    "rampatch_00230302.bin",       rampatch_00230302_bin      ),
+    FW_DESC(    "rampatch_00440302.bin",       rampatch_00440302_bin      ),
     
-    {      "rampatch_usb_00000200.bin", rampatch_usb_00000200_bin  },
-    {      "rampatch_usb_00000201.bin", rampatch_usb_00000201_bin  },
-    {      "rampatch_usb_00000300.bin", rampatch_usb_00000300_bin  },
-    {      "rampatch_usb_00000302.bin", rampatch_usb_00000302_bin  },
+    FW_DESC(    "rampatch_usb_00000200.bin",   rampatch_usb_00000200_bin  ),
+    FW_DESC(    "rampatch_usb_00000201.bin",   rampatch_usb_00000201_bin  ),
+    FW_DESC(    "rampatch_usb_00000300.bin",   rampatch_usb_00000300_bin  ),
+    FW_DESC(    "rampatch_usb_00000302.bin",   rampatch_usb_00000302_bin  ),
     
-    {      "crnv21.bin",                crnv21_bin                 },
-    {      "crnv32.bin",                crnv32_bin                 },
-    {      "crnv32u.bin",               crnv32u_bin                },
-    {      "htnv20.bin",                htnv20_bin                 },
+    FW_DESC(    "crnv21.bin",                  crnv21_bin                 ),
+    FW_DESC(    "crnv32.bin",                  crnv32_bin                 ),
+    FW_DESC(    "crnv32u.bin",                 crnv32u_bin                ),
+    FW_DESC(    "htnv20.bin",                  htnv20_bin                 ),
     
-    {      "nvm_00130300.bin",          nvm_00130300_bin           },
-    {      "nvm_00130302.bin",          nvm_00130302_bin           },
-    {      "nvm_00230302.bin",          nvm_00230302_bin           },
-    {      "nvm_00440302.bin",          nvm_00440302_bin           },
-    {      "nvm_00440302_eu.bin",       nvm_00440302_eu_bin        },
-    {      "nvm_00440302_i2s_eu.bin",   nvm_00440302_i2s_eu_bin    },
+    FW_DESC(    "nvm_00130300.bin",            nvm_00130300_bin           ),
+    FW_DESC(    "nvm_00130302.bin",            nvm_00130302_bin           ),
+    FW_DESC(    "nvm_00230302.bin",            nvm_00230302_bin           ),
+    FW_DESC(    "nvm_00440302.bin",            nvm_00440302_bin           ),
+    FW_DESC(    "nvm_00440302_eu.bin",         nvm_00440302_eu_bin        ),
+    FW_DESC(    "nvm_00440302_i2s_eu.bin",     nvm_00440302_i2s_eu_bin    ),
     
-    {      "nvm_usb_00000200.bin",      nvm_usb_00000200_bin       },
-    {      "nvm_usb_00000201.bin",      nvm_usb_00000201_bin       },
-    {      "nvm_usb_00000300.bin",      nvm_usb_00000300_bin       },
-    {      "nvm_usb_00000302.bin",      nvm_usb_00000302_bin       },
-    {      "nvm_usb_00000302_eu.bin",   nvm_usb_00000302_eu_bin    }
+    FW_DESC(    "nvm_usb_00000200.bin",        nvm_usb_00000200_bin       ),
+    FW_DESC(    "nvm_usb_00000201.bin",        nvm_usb_00000201_bin       ),
+    FW_DESC(    "nvm_usb_00000300.bin",        nvm_usb_00000300_bin       ),
+    FW_DESC(    "nvm_usb_00000302.bin",        nvm_usb_00000302_bin       ),
+    FW_DESC(    "nvm_usb_00000302_eu.bin",     nvm_usb_00000302_eu_bin    )
 };
 
-static inline OSData *getFwDescByName(const char * name)
+/* Usable in constant expressions, so tables naming firmware can be checked at build time */
+constexpr const FwDesc *findFwDesc(const char * name)
 {
-    for (int i = 0; i < ARRAY_SIZE(fwList); ++i)
+    for (size_t i = 0; i < ARRAY_SIZE(fwList); ++i)
     {
-        if (fwList[i].name == name)
+        size_t j = 0;
+        
+        while (name[j] && name[j] == fwList[i].name[j])
+        {
+            ++j;
+        }
+        
+        if (name[j] == fwList[i].name[j])
         {
-            return OSData::withBytes(fwList[i].var, sizeof(* fwList[i].var));
+            return &fwList[i];
         }
     }
     return NULL;
 }
 
+/* The returned OSData wraps the embedded image without copying it, treat it as read-only */
+static inline OSData *getFwDescByName(const char * name)
+{
+    const FwDesc * desc = findFwDesc(name);
+    
+    if (!desc)
+    {
+        return NULL;
+    }
+    
+    return OSData::withBytesNoCopy((void *) desc->var, (unsigned int) desc->size);
+}
+
 #endif /* Firmware_h */
@@ -201,6 +201,11 @@ enum
 #define HCI_ACL_HDR_SIZE                            4
 #define HCI_SCO_HDR_SIZE                            3
 
+#define HCI_MAX_EVENT_SIZE                          260
+#define HCI_MAX_COMMAND_PLEN                        255
+#define HCI_CMD_COMPLETE_HDR_SIZE                   3       /* ncmd + opcode */
+#define HCI_CMD_STATUS_HDR_SIZE                     4       /* status + ncmd + opcode */
+
 static uint8_t EXIT_MFG_PARAM[2]                    = { 0x00, 0x02 };
 static uint8_t ENTER_MFG_PARAM[2]                   = { 0x01, 0x00 };
 static uint8_t EVENT_MASK[8]                        = { 0x87, 0x0c, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
@@ -0,0 +1,135 @@
+//
+//  HciEvent.h
+//  QCABluetoothFirmware
+//
+//  Copyright © 2021 cjiang. All rights reserved.
+//
+
+#ifndef HciEvent_h
+#define HciEvent_h
+
+#include <Hci.h>
+
+/* Read-only views over a received HCI event.
+ *
+ * A view never copies the event: it keeps a pointer into the buffer the
+ * event was received in and decodes each field on access, after checking
+ * that the field lies within the event. A view is only valid for as long
+ * as the buffer it points to is.
+ */
+class HciEventView
+{
+public:
+    HciEventView(const u8 * data, u16 length) : m_data(data), m_length(length) {}
+
+    bool isValid() const
+    {
+        return m_data && m_length >= HCI_EVENT_HDR_SIZE && m_length >= HCI_EVENT_HDR_SIZE + m_data[1];
+    }
+
+    u8 code() const                         { return m_data[0]; }
+    u8 paramLen() const                     { return m_data[1]; }
+    const u8 * params() const               { return m_data + HCI_EVENT_HDR_SIZE; }
+
+protected:
+    bool hasParams(u16 offset, u16 size) const
+    {
+        return isValid() && offset + size <= paramLen();
+    }
+
+    u8 param8(u16 offset) const             { return params()[offset]; }
+    u16 param16(u16 offset) const           { return get_unaligned_le16(params() + offset); }
+
+    const u8        *   m_data;
+    u16                 m_length;
+};
+
+/* Command Complete: ncmd, opcode, return parameters (status first) */
+class HciCmdCompleteView : public HciEventView
+{
+public:
+    HciCmdCompleteView(const u8 * data, u16 length) : HciEventView(data, length) {}
+
+    bool isValid() const
+    {
+        return hasParams(0, HCI_CMD_COMPLETE_HDR_SIZE) && code() == HCI_EV_CMD_COMPLETE;
+    }
+
+    u8 numCommands() const                  { return param8(0); }
+    u16 opcode() const                      { return param16(1); }
+    const u8 * returnParams() const         { return params() + HCI_CMD_COMPLETE_HDR_SIZE; }
+    u8 returnParamLen() const               { return paramLen() - HCI_CMD_COMPLETE_HDR_SIZE; }
+
+    u8 status() const
+    {
+        return returnParamLen() ? returnParams()[0] : 0xff;
+    }
+};
+
+/* Command Status: status, ncmd, opcode */
+class HciCmdStatusView : public HciEventView
+{
+public:
+    HciCmdStatusView(const u8 * data, u16 length) : HciEventView(data, length) {}
+
+    bool isValid() const
+    {
+        return hasParams(0, HCI_CMD_STATUS_HDR_SIZE) && code() == HCI_EV_CMD_STATUS;
+    }
+
+    u8 status() const                       { return param8(0); }
+    u8 numCommands() const                  { return param8(1); }
+    u16 opcode() const                      { return param16(2); }
+};
+
+/* LE Meta: subevent code followed by the subevent parameters */
+class HciLeMetaView : public HciEventView
+{
+public:
+    HciLeMetaView(const u8 * data, u16 length) : HciEventView(data, length) {}
+
+    bool isValid() const
+    {
+        return hasParams(0, 1) && code() == HCI_EV_LE_META;
+    }
+
+    u8 subevent() const                     { return param8(0); }
+    const u8 * data() const                 { return params() + 1; }
+    u8 dataLen() const                      { return paramLen() - 1; }
+};
+
+/* QCA EDL reply: cresp, rtype, payload.
+ *
+ * Built over the reply parameters rather than a whole event, since the
+ * EDL reply is carried either by a vendor specific event or, on WCN3991
+ * and later, by the return parameters of a Command Complete.
+ */
+class EdlEventView
+{
+public:
+    EdlEventView(const u8 * data, u8 length) : m_data(data), m_length(length) {}
+
+    bool isValid() const                    { return m_data && m_length >= 2; }
+
+    u8 cresp() const                        { return m_data[0]; }
+    u8 rtype() const                        { return m_data[1]; }
+    const u8 * data() const                 { return m_data + 2; }
+    u8 dataLen() const                      { return m_length - 2; }
+
+    /* Typed access to the payload, NULL if it is too short */
+    template <typename T>
+    const T * payload(u8 offset = 0) const
+    {
+        if (!isValid() || offset + sizeof(T) > dataLen())
+        {
+            return NULL;
+        }
+        return (const T *) (data() + offset);
+    }
+
+private:
+    const u8        *   m_data;
+    u8                  m_length;
+};
+
+#endif /* HciEvent_h */
@@ -0,0 +1,113 @@
+//
+//  HciEventDispatcher.h
+//  QCABluetoothFirmware
+//
+//  Copyright © 2021 cjiang. All rights reserved.
+//
+
+#ifndef HciEventDispatcher_h
+#define HciEventDispatcher_h
+
+#include <libkern/c++/OSObject.h>
+#include <HciEvent.h>
+
+#define HCI_EVENT_CODE_COUNT                        256
+
+/* Called with the whole event (header included) */
+typedef void (*HciEventAction)(OSObject * owner, const u8 * data, u16 length);
+
+struct HciEventHandler
+{
+    OSObject                *   owner;
+    HciEventAction              action;
+};
+
+/* Routes received events to the subsystem that subscribed to them.
+ *
+ * One slot per event code, plus one slot per EDL reply type (the rtype of
+ * an HCI_EV_VENDOR carrying an EDL reply, EDL_*_EVT), so dispatching is a
+ * single lookup and never allocates. A code has at most one subscriber.
+ */
+class HciEventDispatcher
+{
+public:
+    constexpr HciEventDispatcher() : m_handlers{}, m_vendorHandlers{} {}
+
+    bool subscribe(u8 event, OSObject * owner, HciEventAction action)
+    {
+        return set(m_handlers[event], owner, action);
+    }
+
+    bool subscribeVendor(u8 rtype, OSObject * owner, HciEventAction action)
+    {
+        return set(m_vendorHandlers[rtype], owner, action);
+    }
+
+    void unsubscribe(u8 event)
+    {
+        m_handlers[event] = HciEventHandler {};
+    }
+
+    void unsubscribeVendor(u8 rtype)
+    {
+        m_vendorHandlers[rtype] = HciEventHandler {};
+    }
+
+    void reset()
+    {
+        for (int i = 0; i < HCI_EVENT_CODE_COUNT; ++i)
+        {
+            m_handlers[i] = m_vendorHandlers[i] = HciEventHandler {};
+        }
+    }
+
+    /* Returns false if nobody was subscribed to the event */
+    bool dispatch(const u8 * data, u16 length) const
+    {
+        HciEventView evt(data, length);
+        const HciEventHandler * handler;
+
+        if (!evt.isValid())
+        {
+            return false;
+        }
+
+        /* cresp comes first and is always EDL_CMD_REQ_RES_EVT, the type is next */
+        EdlEventView edl(evt.params(), evt.paramLen());
+
+        if (evt.code() == HCI_EV_VENDOR && edl.isValid() && m_vendorHandlers[edl.rtype()].action)
+        {
+            handler = &m_vendorHandlers[edl.rtype()];
+        }
+        else
+        {
+            handler = &m_handlers[evt.code()];
+        }
+
+        if (!handler->action)
+        {
+            return false;
+        }
+
+        handler->action(handler->owner, data, length);
+        return true;
+    }
+
+private:
+    static bool set(HciEventHandler & handler, OSObject * owner, HciEventAction action)
+    {
+        if (handler.action && action)
+        {
+            return false;
+        }
+
+        handler.owner = owner;
+        handler.action = action;
+        return true;
+    }
+
+    HciEventHandler             m_handlers[HCI_EVENT_CODE_COUNT];
+    HciEventHandler             m_vendorHandlers[HCI_EVENT_CODE_COUNT];
+};
+
+#endif /* HciEventDispatcher_h */
@@ -0,0 +1,49 @@
+//
+//  QCATransport.h
+//  QCABluetoothFirmware
+//
+//  Copyright © 2021 cjiang. All rights reserved.
+//
+
+#ifndef QCATransport_h
+#define QCATransport_h
+
+#include <IOKit/IOReturn.h>
+#include <HciEventDispatcher.h>
+
+/* A link to the controller other than the USB control / interrupt pipes.
+ *
+ * Commands go out whole (header included) through sendCommand, events
+ * come back through the action given to the constructor, on whatever
+ * thread the transport reads on. Speed is in bits per second.
+ */
+class QCATransport
+{
+public:
+    QCATransport(OSObject * owner, HciEventAction action) : m_owner(owner), m_eventAction(action) {}
+    virtual ~QCATransport() {}
+
+    virtual const char  *   getName() const = 0;
+
+    virtual bool            open(u32 speed) = 0;
+    virtual void            close() = 0;
+
+    virtual IOReturn        sendCommand(const HciCommandHdr * cmd, UInt32 timeout) = 0;
+
+    virtual IOReturn        setSpeed(u32 speed)     { return kIOReturnUnsupported; }
+    virtual u32             getSpeed() const        { return 0; }
+
+    /* Let the controller sleep while the link is idle */
+    virtual IOReturn        setInBandSleep(bool enable) { return kIOReturnUnsupported; }
+
+    /* Single raw byte at the given speed, for SoC's powered through the TX line */
+    virtual IOReturn        sendPowerPulse(u8 pulse, u32 speed) { return kIOReturnUnsupported; }
+
+protected:
+    void                    deliverEvent(const u8 * data, u16 length)   { m_eventAction(m_owner, data, length); }
+
+    OSObject            *   m_owner;
+    HciEventAction          m_eventAction;
+};
+
+#endif /* QCATransport_h */